@@ -0,0 +1,21 @@
+# Writes the compiled shaders into a header of uint32_t arrays, one per shader, in namespace spirv
+#   cmake -DSPV_DIR=<dir with name.spv> -DNAMES=name,name,... -DOUTPUT=<header> -P embed_spirv.cmake
+
+string(REPLACE "," ";" NAMES "${NAMES}")
+
+set(CONTENT "// generated from the compiled shaders by cmake/embed_spirv.cmake, do not edit\n")
+string(APPEND CONTENT "#pragma once\n#include <cstdint>\n\nnamespace spirv {\n")
+
+foreach(NAME ${NAMES})
+    file(READ ${SPV_DIR}/${NAME}.spv HEX HEX)
+    # SPIR-V is a stream of little-endian words, swap each group of four bytes into one literal
+    string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1, " WORDS "${HEX}")
+    # eight words to a line, cmake regexes have no {n} repeat
+    set(WORD "0x........, ")
+    string(REGEX REPLACE "(${WORD}${WORD}${WORD}${WORD}${WORD}${WORD}${WORD}${WORD})" "\\1\n    " WORDS
+           "${WORDS}")
+    string(APPEND CONTENT "\nalignas(16) inline constexpr uint32_t ${NAME}[] = {\n    ${WORDS}\n};\n")
+endforeach()
+
+string(APPEND CONTENT "\n} // namespace spirv\n")
+file(WRITE ${OUTPUT} "${CONTENT}")
@@ -0,0 +1,95 @@
+# Runs the engine headless on generated scenes, merges the per run reports into one and flags regressions
+# against a baseline
+#   cmake -DENGINE=<VulkanTest> -DOUTPUT=<perf.json> -DBASELINE=<baseline.json> -DTOLERANCES=<tolerances.json>
+#         [-DUPDATE_BASELINE=ON] -P perf_suite.cmake
+# every metric is lower-is-better, one is a regression when it exceeds the baseline by more than its
+# relative tolerance. scenes or metrics missing from either side are skipped
+
+cmake_minimum_required(VERSION 3.19)
+
+# scene:bodies:frames, the frame count falls as the scenes grow so each run stays within a minute or so
+set(SCENES
+    grid:100:300 grid:1000:300 grid:10000:300 grid:100000:100 grid:1000000:30
+    orbit:100:300 orbit:1000:300 orbit:10000:300 orbit:100000:50 orbit:1000000:10
+)
+
+# a check without a baseline would pass on anything, fail before spending minutes on the runs
+if(NOT UPDATE_BASELINE AND NOT EXISTS ${BASELINE})
+    message(FATAL_ERROR "perf: no baseline at ${BASELINE}, build the perf-baseline target to record one")
+endif()
+
+get_filename_component(WORK_DIR ${OUTPUT} DIRECTORY)
+set(REPORT "{}")
+
+foreach(SCENE ${SCENES})
+    string(REPLACE ":" ";" FIELDS ${SCENE})
+    list(GET FIELDS 0 KIND)
+    list(GET FIELDS 1 BODIES)
+    list(GET FIELDS 2 FRAMES)
+
+    set(ARGS --headless --no-validation --frames ${FRAMES} --bodies ${BODIES})
+    # the orbit scene steps the CPU simulation in lockstep with the frames, the grid stands still
+    if(KIND STREQUAL "orbit")
+        list(APPEND ARGS --simulate cpu)
+    endif()
+
+    set(RUN_REPORT ${WORK_DIR}/perf_${KIND}_${BODIES}.json)
+    message(STATUS "perf: ${KIND} scene, ${BODIES} bodies, ${FRAMES} frames")
+    execute_process(COMMAND ${ENGINE} ${ARGS} --report ${RUN_REPORT}
+                    RESULT_VARIABLE RESULT OUTPUT_QUIET)
+    if(NOT RESULT EQUAL 0)
+        message(FATAL_ERROR "perf: ${KIND} scene with ${BODIES} bodies failed (${RESULT})")
+    endif()
+
+    file(READ ${RUN_REPORT} RUN)
+    string(JSON REPORT SET "${REPORT}" "${KIND}-${BODIES}" "${RUN}")
+endforeach()
+
+file(WRITE ${OUTPUT} "${REPORT}\n")
+message(STATUS "perf: report written to ${OUTPUT}")
+
+if(UPDATE_BASELINE)
+    file(COPY_FILE ${OUTPUT} ${BASELINE})
+    message(STATUS "perf: baseline updated at ${BASELINE}")
+    return()
+endif()
+
+file(READ ${BASELINE} BASE)
+file(READ ${TOLERANCES} TOLERANCE)
+
+set(REGRESSIONS "")
+string(JSON SCENE_COUNT LENGTH "${REPORT}")
+math(EXPR LAST_SCENE "${SCENE_COUNT} - 1")
+string(JSON METRIC_COUNT LENGTH "${TOLERANCE}")
+math(EXPR LAST_METRIC "${METRIC_COUNT} - 1")
+
+foreach(I RANGE ${LAST_SCENE})
+    string(JSON SCENE MEMBER "${REPORT}" ${I})
+    string(JSON BASE_SCENE ERROR_VARIABLE MISSING GET "${BASE}" ${SCENE})
+    if(MISSING)
+        continue()
+    endif()
+
+    foreach(J RANGE ${LAST_METRIC})
+        string(JSON METRIC MEMBER "${TOLERANCE}" ${J})
+        string(JSON PERCENT GET "${TOLERANCE}" ${METRIC})
+        string(JSON NOW ERROR_VARIABLE MISSING GET "${REPORT}" ${SCENE} ${METRIC})
+        string(JSON BEFORE ERROR_VARIABLE MISSING_BEFORE GET "${BASE_SCENE}" ${METRIC})
+        if(MISSING OR MISSING_BEFORE)
+            continue()
+        endif()
+
+        # now > before * (1 + percent / 100), in integers
+        math(EXPR SCALED_NOW "${NOW} * 100")
+        math(EXPR SCALED_LIMIT "${BEFORE} * (100 + ${PERCENT})")
+        if(SCALED_NOW GREATER SCALED_LIMIT)
+            list(APPEND REGRESSIONS "${SCENE} ${METRIC}: ${BEFORE} -> ${NOW} (tolerance ${PERCENT}%)")
+        endif()
+    endforeach()
+endforeach()
+
+if(REGRESSIONS)
+    list(JOIN REGRESSIONS "\n  " LINES)
+    message(FATAL_ERROR "perf: regressions against ${BASELINE}\n  ${LINES}")
+endif()
+message(STATUS "perf: no regressions against ${BASELINE}")
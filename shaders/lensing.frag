@@ -0,0 +1,82 @@
+#version 450
+
+layout(location = 0) in vec2 ndc;
+
+layout(location = 0) out vec4 outColor;
+
+// bodies drawn without lensing, alpha 0 where nothing was drawn
+layout(set = 0, binding = 0) uniform sampler2D scene;
+// (deflection, captured) over impact parameter (x) and log observer distance (y)
+layout(set = 0, binding = 1) uniform sampler2D deflectionTable;
+
+// the table layout only changes with the table, so it is specialized in when the pipeline is built. the
+// sample counts are floats so they build the size vector without a conversion
+layout(constant_id = 0) const float impactSamples = 1024.0;
+layout(constant_id = 1) const float distanceSamples = 64.0;
+layout(constant_id = 2) const float maxImpact = 64.0;
+layout(constant_id = 3) const float minLogDistance = 1.3863;
+layout(constant_id = 4) const float maxLogDistance = 9.2103;
+
+layout(push_constant) uniform Lens {
+    float observerDistance;
+    float tanHalfFov;
+    float aspect;
+} lens;
+
+float hash(vec3 p) {
+    p = fract(p * vec3(443.897, 441.423, 437.195));
+    p += dot(p, p.yzx + 19.19);
+    return fract((p.x + p.y) * p.z);
+}
+
+// sparse point stars, one candidate per cell of a grid laid over the direction sphere
+vec3 starfield(vec3 dir) {
+    const float density = 120.0;
+    vec3 p = dir * density;
+    vec3 cell = floor(p);
+
+    float brightness = hash(cell);
+    if (brightness < 0.97)
+        return vec3(0.0);
+
+    vec3 star = cell + vec3(hash(cell + 1.7), hash(cell + 3.1), hash(cell + 5.3));
+    float falloff = exp(-40.0 * dot(p - star, p - star));
+    vec3 tint = mix(vec3(1.0, 0.8, 0.6), vec3(0.6, 0.8, 1.0), hash(cell + 7.9));
+    return tint * falloff * (brightness - 0.97) / 0.03;
+}
+
+void main() {
+    // angle from the optical axis, the hole sits at the center of the screen
+    vec2 tangent = ndc * vec2(lens.aspect, 1.0) * lens.tanHalfFov;
+    float t = length(tangent);
+    float alpha = atan(t);
+    vec2 radial = t > 0.0 ? tangent / t : vec2(1.0, 0.0);
+
+    // impact parameter a static observer assigns to a ray leaving at this angle
+    float r = lens.observerDistance;
+    float b = r * sin(alpha) / sqrt(1.0 - 2.0 / r);
+
+    vec2 size = vec2(impactSamples, distanceSamples);
+    float row = (log(r) - minLogDistance) / (maxLogDistance - minLogDistance);
+    float column = min(b / maxImpact, 1.0);
+    vec2 entry = texture(deflectionTable, (vec2(column, row) * (size - 1.0) + 0.5) / size).rg;
+
+    // past the table the bend falls off like the weak field 1 / b
+    if (b > maxImpact)
+        entry = vec2(entry.x * maxImpact / b, 0.0);
+
+    // direction the ray leaves in, bending toward the axis and past it for the inner images
+    float bent = alpha - entry.x;
+    vec3 color = starfield(vec3(sin(bent) * radial, cos(bent)));
+
+    // the scene is a backdrop far behind the hole seen through the same camera
+    if (cos(bent) > 0.0) {
+        vec2 source = tan(bent) * radial / (vec2(lens.aspect, 1.0) * lens.tanHalfFov);
+        if (all(lessThanEqual(abs(source), vec2(1.0)))) {
+            vec4 body = texture(scene, source * 0.5 + 0.5);
+            color = mix(color, body.rgb, body.a);
+        }
+    }
+
+    outColor = vec4(color * (1.0 - entry.y), 1.0);
+}
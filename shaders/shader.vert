@@ -3,10 +3,14 @@
 layout(location = 0) in vec2 inPosition;
 layout(location = 1) in vec3 inColor;
 
+// cull.comp resolves the centers and applies the zoom, instances arrive in clip space
+layout(location = 2) in vec2 instanceCenter;
+layout(location = 3) in float instanceRadius;
+layout(location = 4) in vec3 instanceColor;
+
 layout(location = 0) out vec3 fragColor;
 
 void main() {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
-    fragColor = inColor;
+    gl_Position = vec4(instanceCenter + instanceRadius * inPosition, 0.0, 1.0);
+    fragColor = inColor * instanceColor;
 }
-
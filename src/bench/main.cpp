@@ -0,0 +1,257 @@
+#include "../engine/engine.h"
+#include "../engine/gravity.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+
+using namespace std;
+
+// CPU hot paths timed without a window or device, every benchmark is calibrated to a minimum sample time and
+// then repeated so the spread can be told apart from a regression
+
+struct BenchmarkResult {
+  string name;
+  uint64_t iterations;
+  // nanoseconds per iteration over all samples
+  double min, median, mean, stddev, max;
+  // work done per iteration (vertices, bytes, interactions), 0 when there is no natural unit
+  double items;
+};
+
+struct BenchmarkSettings {
+  uint32_t samples = 20;
+  double minSampleSeconds = 0.005;
+  string filter;
+};
+
+// keeps the compiler from dropping a result nothing reads
+template <typename T> static void keep(const T &value) { asm volatile("" : : "r,m"(value) : "memory"); }
+
+static double timeIterations(const function<void()> &body, uint64_t iterations) {
+  auto start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < iterations; i++)
+    body();
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+class BenchmarkRunner {
+private:
+  BenchmarkSettings settings;
+
+public:
+  vector<BenchmarkResult> results;
+
+  BenchmarkRunner(BenchmarkSettings settings) : settings(std::move(settings)) {}
+
+  void run(const string &name, double items, const function<void()> &body) {
+    if (!settings.filter.empty() && name.find(settings.filter) == string::npos)
+      return;
+
+    // warm the caches and the allocator, then double the iterations until one sample is long enough
+    body();
+    uint64_t iterations = 1;
+    while (timeIterations(body, iterations) < settings.minSampleSeconds && iterations < (1ull << 30))
+      iterations *= 2;
+
+    vector<double> samples(settings.samples);
+    for (double &sample : samples)
+      sample = timeIterations(body, iterations) * 1e9 / iterations;
+    sort(samples.begin(), samples.end());
+
+    double mean = 0.0;
+    for (double sample : samples)
+      mean += sample;
+    mean /= samples.size();
+    double variance = 0.0;
+    for (double sample : samples)
+      variance += (sample - mean) * (sample - mean);
+    variance /= max<size_t>(1, samples.size() - 1);
+
+    size_t n = samples.size();
+    double median = n % 2 ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+    results.push_back({.name = name,
+                       .iterations = iterations,
+                       .min = samples.front(),
+                       .median = median,
+                       .mean = mean,
+                       .stddev = sqrt(variance),
+                       .max = samples.back(),
+                       .items = items});
+
+    printf("%-36s %12.0f ns  +- %5.1f%%", name.c_str(), median, 100.0 * sqrt(variance) / mean);
+    if (items > 0)
+      printf("  %10.2f M/s", items / median * 1e3);
+    printf("\n");
+  }
+
+  bool write(const string &path) const {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file)
+      return false;
+
+    fprintf(file, "{\"samples\": %u, \"benchmarks\": [", settings.samples);
+    for (size_t i = 0; i < results.size(); i++) {
+      const BenchmarkResult &r = results[i];
+      fprintf(file,
+              "%s\n{\"name\": \"%s\", \"iterations\": %llu, \"min_ns\": %.1f, \"median_ns\": %.1f, "
+              "\"mean_ns\": %.1f, \"stddev_ns\": %.1f, \"max_ns\": %.1f, \"items\": %.0f}",
+              i ? "," : "", r.name.c_str(), static_cast<unsigned long long>(r.iterations), r.min, r.median,
+              r.mean, r.stddev, r.max, r.items);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+  }
+};
+
+static void benchmarkMeshes(BenchmarkRunner &runner) {
+  for (uint32_t increments : {64u, 1024u, 10000u, 100000u}) {
+    runner.run("createSphere/" + to_string(increments), increments + 1.0, [=]() {
+      RigidBody body = RigidBody::createSphere(0.0f, 0.0f, 1.0f, {1.0f, 1.0f, 1.0f}, increments);
+      keep(body.vertices.data());
+    });
+  }
+
+  runner.run("createCircleLods", 0.0, []() {
+    RigidBody body = RigidBody::createCircleLods({1.0f, 1.0f, 1.0f});
+    keep(body.vertices.data());
+  });
+}
+
+// the packing steps of loadToGpu on a scene like the engine's plus a spread of standalone meshes
+static void benchmarkPacking(BenchmarkRunner &runner) {
+  RigidBodyManager manager(nullptr);
+
+  RigidBody circle = RigidBody::createCircleLods({1.0f, 1.0f, 1.0f});
+  ParticleStore particles;
+  buildOrbitScene(10000, 1.0f, particles, circle.instances);
+  manager.addGeometry(std::move(circle), "circle");
+  for (int i = 0; i < 64; i++) {
+    RigidBody sphere = RigidBody::createSphere(0.0f, 0.0f, 1.0f, {1.0f, 0.0f, 0.0f}, 16u << (i % 8));
+    manager.addGeometry(std::move(sphere), "sphere" + to_string(i));
+  }
+
+  double meshes = static_cast<double>(manager.geometries.size());
+  runner.run("calculateOffsets", meshes, [&]() {
+    manager.calculateOffsets();
+    keep(manager.geometries.begin()->vertexOffset);
+  });
+
+  runner.run("getSizes", meshes, [&]() { keep(manager.getSizes()); });
+
+  const pair<VertexLayout, const char *> layouts[] = {
+      {VertexLayout::Float, "float"}, {VertexLayout::Half, "half"}, {VertexLayout::Snorm16, "snorm16"}};
+  for (auto [layout, layoutName] : layouts) {
+    manager.vertexLayout = layout;
+    manager.calculateOffsets();
+    auto [indexSize, vertexSize, instanceSize] = manager.getSizes();
+    vector<uint8_t> vertexData(vertexSize), indexData(indexSize);
+    runner.run(string("packMeshes/") + layoutName, static_cast<double>(vertexSize + indexSize), [&]() {
+      manager.packMeshes(vertexData, indexData);
+      keep(vertexData.data());
+    });
+  }
+
+  // hashing and comparing against the mesh already there, the copy of the body is included
+  RigidBody duplicate = RigidBody::createCircleLods({1.0f, 1.0f, 1.0f});
+  runner.run("addGeometry/duplicate", static_cast<double>(duplicate.vertices.size()),
+             [&]() { keep(manager.addGeometry(duplicate, "duplicate")); });
+
+  // an unnamed body in and out again, the slot is recycled every time
+  RigidBody square = RigidBody::createSquare(0.0f, 0.0f, 1.0f, {1.0f, 1.0f, 1.0f});
+  runner.run("addRemoveGeometry", 0.0, [&]() { manager.removeGeometry(manager.addGeometry(square)); });
+}
+
+// the same shape in two colors has to end up as one mesh, the colors stay with the geometries
+static bool checkColorDedup() {
+  RigidBodyManager manager(nullptr);
+  SlotHandle red = manager.addGeometry(RigidBody::createSphere(0.0f, 0.0f, 1.0f, {1.0f, 0.0f, 0.0f}, 64));
+  SlotHandle blue = manager.addGeometry(RigidBody::createSphere(0.0f, 0.0f, 1.0f, {0.0f, 0.0f, 1.0f}, 64));
+
+  const RigidBody &redBody = manager.geometries.at(red), &blueBody = manager.geometries.at(blue);
+  return manager.meshes.size() == 1 && redBody.mesh == blueBody.mesh &&
+         redBody.color == glm::vec3(1.0f, 0.0f, 0.0f) && blueBody.color == glm::vec3(0.0f, 0.0f, 1.0f);
+}
+
+static void benchmarkGravity(BenchmarkRunner &runner) {
+  mt19937 rng(1);
+  uniform_real_distribution<float> position(-1.0f, 1.0f), mass(0.0f, 1.0f);
+
+  for (size_t n : {1024, 4096}) {
+    vector<float> x(n), y(n), m(n), ax(n), ay(n);
+    for (size_t i = 0; i < n; i++) {
+      x[i] = position(rng);
+      y[i] = position(rng);
+      m[i] = mass(rng);
+    }
+
+    for (auto const &info : supportedGravityKernels()) {
+      runner.run(string("gravity/") + info.name + "/" + to_string(n), static_cast<double>(n * n), [&]() {
+        info.kernel(x.data(), y.data(), n, x.data(), y.data(), m.data(), n, 1e-6f, ax.data(), ay.data());
+        keep(ax.data());
+      });
+    }
+  }
+
+  // a full leapfrog step on the orbit scene, tree build included
+  for (uint32_t bodies : {10000u, 100000u}) {
+    ParticleStore particles;
+    vector<Instance> instances;
+    buildOrbitScene(bodies, 1.0f, particles, instances);
+    BarnesHutSolver solver;
+    runner.run("barnesHut/step/" + to_string(bodies), bodies, [&]() {
+      solver.step(particles, 1e-4f);
+      keep(particles.x.data());
+    });
+  }
+}
+
+int main(int argc, char **argv) {
+  BenchmarkSettings settings;
+  string output = "bench.json";
+  bool checkOnly = false;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--samples" && i + 1 < argc) {
+      settings.samples = max(1, atoi(argv[++i]));
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      settings.minSampleSeconds = atof(argv[++i]) / 1000.0;
+    } else if (arg == "--filter" && i + 1 < argc) {
+      settings.filter = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      output = argv[++i];
+    } else if (arg == "--check") {
+      checkOnly = true;
+    } else {
+      cerr << "usage: " << argv[0] << " [--samples N] [--min-time ms] [--filter name] [--output bench.json]"
+           << " [--check]" << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // timings of a broken dedupe would be meaningless, so the benchmarks check it first
+  if (!checkColorDedup()) {
+    cerr << "same-shape geometries in different colors did not share a mesh!" << endl;
+    return EXIT_FAILURE;
+  }
+  if (checkOnly) {
+    cout << "checks passed" << endl;
+    return EXIT_SUCCESS;
+  }
+
+  BenchmarkRunner runner(settings);
+  benchmarkMeshes(runner);
+  benchmarkPacking(runner);
+  benchmarkGravity(runner);
+
+  if (!runner.write(output)) {
+    cerr << "failed to write " << output << "!" << endl;
+    return EXIT_FAILURE;
+  }
+  cout << runner.results.size() << " benchmarks written to " << output << endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+#include "engine.h"
+#include <algorithm>
+#include <vulkan/vulkan_core.h>
+
+using namespace std;
+
+// small buffers round up to this, it also covers every alignment drivers ask for in practice
+static const VkDeviceSize minAllocation = 256;
+
+void DeviceAllocator::create(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize) {
+  this->device = device;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+  pools.resize(2 * memoryProperties.memoryTypeCount);
+  for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; type++) {
+    // small heaps (host-visible BAR windows) get smaller blocks so one block cannot take a large share
+    VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[type].heapIndex].size;
+    VkDeviceSize size = blockSize;
+    while (size > minAllocation && size > heapSize / 8)
+      size /= 2;
+
+    for (uint32_t tiling = 0; tiling < 2; tiling++) {
+      pools[2 * type + tiling] = {.memoryType = type, .blockSize = size};
+    }
+  }
+}
+
+void DeviceAllocator::destroy() {
+  for (Pool &pool : pools) {
+    for (auto &block : pool.blocks) {
+      if (block->mapped)
+        vkUnmapMemory(device, block->memory);
+      vkFreeMemory(device, block->memory, nullptr);
+    }
+    pool.blocks.clear();
+  }
+}
+
+uint32_t DeviceAllocator::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const {
+  for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+    VkMemoryPropertyFlags flags = memoryProperties.memoryTypes[i].propertyFlags;
+    if ((typeFilter & (1 << i)) && (flags & properties) == properties) {
+      return i;
+    }
+  }
+
+  throw runtime_error("failed to find suitable memory type!");
+}
+
+VkDeviceMemory DeviceAllocator::allocateMemory(uint32_t memoryType, VkDeviceSize size, void **mapped) {
+  VkMemoryAllocateInfo allocInfo{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = size,
+      .memoryTypeIndex = memoryType,
+  };
+
+  VkDeviceMemory memory;
+  if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate device memory!");
+  }
+
+  *mapped = nullptr;
+  if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, mapped);
+  return memory;
+}
+
+Allocation DeviceAllocator::allocate(const VkMemoryRequirements &requirements,
+                                     VkMemoryPropertyFlags properties, ResourceTiling tiling) {
+  uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, properties);
+  uint32_t poolIndex = 2 * memoryType + static_cast<uint32_t>(tiling);
+  Pool &pool = pools[poolIndex];
+  requestedBytes += requirements.size;
+
+  if (requirements.size >= pool.blockSize / 2) {
+    Allocation allocation{.size = requirements.size, .pool = poolIndex, .dedicated = true};
+    allocation.memory = allocateMemory(memoryType, requirements.size, &allocation.mapped);
+    dedicatedCount++;
+    dedicatedBytes += requirements.size;
+    return allocation;
+  }
+
+  auto place = [&](uint32_t index) -> optional<Allocation> {
+    Block &block = *pool.blocks[index];
+    optional<uint64_t> offset = block.buddy.allocate(requirements.size, requirements.alignment);
+    if (!offset)
+      return nullopt;
+
+    return Allocation{.memory = block.memory,
+                      .offset = *offset,
+                      .size = requirements.size,
+                      .mapped = block.mapped ? static_cast<uint8_t *>(block.mapped) + *offset : nullptr,
+                      .pool = poolIndex,
+                      .block = index};
+  };
+
+  for (uint32_t i = 0; i < pool.blocks.size(); i++) {
+    if (optional<Allocation> allocation = place(i))
+      return *allocation;
+  }
+
+  void *mapped;
+  VkDeviceMemory memory = allocateMemory(memoryType, pool.blockSize, &mapped);
+  pool.blocks.push_back(make_unique<Block>(Block{
+      .memory = memory, .mapped = mapped, .buddy = BuddyAllocator(pool.blockSize, minAllocation)}));
+  return *place(static_cast<uint32_t>(pool.blocks.size() - 1));
+}
+
+void DeviceAllocator::free(Allocation &allocation) {
+  if (allocation.memory == VK_NULL_HANDLE)
+    return;
+
+  requestedBytes -= allocation.size;
+  if (allocation.dedicated) {
+    if (allocation.mapped)
+      vkUnmapMemory(device, allocation.memory);
+    vkFreeMemory(device, allocation.memory, nullptr);
+    dedicatedCount--;
+    dedicatedBytes -= allocation.size;
+  } else {
+    // empty blocks are kept, the next allocation of this kind reuses them without a driver call
+    pools[allocation.pool].blocks[allocation.block]->buddy.free(allocation.offset);
+  }
+
+  allocation = {};
+}
+
+AllocatorStats DeviceAllocator::stats() const {
+  AllocatorStats stats{.allocations = dedicatedCount,
+                       .dedicatedAllocations = dedicatedCount,
+                       .reserved = dedicatedBytes,
+                       .used = dedicatedBytes,
+                       .requested = requestedBytes};
+
+  VkDeviceSize freeBytes = 0, largestFree = 0;
+  for (const Pool &pool : pools) {
+    for (const auto &block : pool.blocks) {
+      stats.blocks++;
+      stats.reserved += block->buddy.getCapacity();
+      stats.used += block->buddy.used();
+      freeBytes += block->buddy.getCapacity() - block->buddy.used();
+      largestFree = max<VkDeviceSize>(largestFree, block->buddy.largestFree());
+      stats.allocations += block->buddy.allocationCount();
+    }
+  }
+
+  stats.fragmentation = freeBytes > 0 ? 1.0f - static_cast<float>(largestFree) / freeBytes : 0.0f;
+  return stats;
+}
@@ -0,0 +1,86 @@
+#include "buddy.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+static uint64_t roundUpPow2(uint64_t x) {
+  uint64_t p = 1;
+  while (p < x)
+    p <<= 1;
+  return p;
+}
+
+BuddyAllocator::BuddyAllocator(uint64_t capacity, uint64_t minBlock)
+    : capacity(capacity), minBlock(minBlock) {
+  uint32_t orders = 1;
+  while ((capacity >> (orders - 1)) > minBlock)
+    orders++;
+
+  freeBlocks.resize(orders);
+  freeBlocks[0].insert(0);
+}
+
+optional<uint64_t> BuddyAllocator::allocate(uint64_t size, uint64_t alignment) {
+  uint64_t need = roundUpPow2(max({size, alignment, minBlock}));
+  if (need > capacity)
+    return nullopt;
+
+  uint32_t order = 0;
+  while (blockSize(order) > need)
+    order++;
+
+  // smallest free block that fits, then split it down
+  uint32_t found = order + 1;
+  for (uint32_t o = order + 1; o-- > 0;) {
+    if (!freeBlocks[o].empty()) {
+      found = o;
+      break;
+    }
+  }
+  if (found > order)
+    return nullopt;
+
+  uint64_t offset = *freeBlocks[found].begin();
+  freeBlocks[found].erase(freeBlocks[found].begin());
+  for (uint32_t o = found; o < order; o++) {
+    // keep the lower half, the upper half becomes a free buddy one order down
+    freeBlocks[o + 1].insert(offset + blockSize(o + 1));
+  }
+
+  allocatedOrder[offset] = order;
+  usedBytes += blockSize(order);
+  return offset;
+}
+
+void BuddyAllocator::free(uint64_t offset) {
+  auto it = allocatedOrder.find(offset);
+  if (it == allocatedOrder.end()) {
+    throw runtime_error("freeing a block the buddy allocator does not own!");
+  }
+
+  uint32_t order = it->second;
+  allocatedOrder.erase(it);
+  usedBytes -= blockSize(order);
+
+  // merge with the buddy for as long as it is free too
+  while (order > 0) {
+    uint64_t buddy = offset ^ blockSize(order);
+    auto free = freeBlocks[order].find(buddy);
+    if (free == freeBlocks[order].end())
+      break;
+
+    freeBlocks[order].erase(free);
+    offset = min(offset, buddy);
+    order--;
+  }
+  freeBlocks[order].insert(offset);
+}
+
+uint64_t BuddyAllocator::largestFree() const {
+  for (uint32_t o = 0; o < freeBlocks.size(); o++) {
+    if (!freeBlocks[o].empty())
+      return blockSize(o);
+  }
+  return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// power-of-two buddy allocator over [0, capacity). every block is aligned to its own size, so any
+// power-of-two alignment up to the rounded request size comes for free
+class BuddyAllocator {
+private:
+  uint64_t capacity, minBlock;
+  // freeBlocks[order] holds the offsets of free blocks of size capacity >> order
+  std::vector<std::set<uint64_t>> freeBlocks;
+  std::unordered_map<uint64_t, uint32_t> allocatedOrder;
+  uint64_t usedBytes = 0;
+
+  uint64_t blockSize(uint32_t order) const { return capacity >> order; }
+
+public:
+  // capacity and minBlock must be powers of two
+  BuddyAllocator(uint64_t capacity, uint64_t minBlock);
+
+  std::optional<uint64_t> allocate(uint64_t size, uint64_t alignment = 1);
+  void free(uint64_t offset);
+
+  uint64_t getCapacity() const { return capacity; }
+  // bytes handed out, rounded up to whole blocks
+  uint64_t used() const { return usedBytes; }
+  uint64_t largestFree() const;
+  size_t allocationCount() const { return allocatedOrder.size(); }
+};
@@ -0,0 +1,231 @@
+#include "engine.h"
+#include "spirv.h"
+#include <vulkan/vulkan_core.h>
+
+using namespace std;
+
+// invocations per workgroup of nbody.comp, and bodies per shared tile
+static const uint32_t workgroupSize = 256;
+
+void VulkanEngine::createDescriptorSetLayouts() {
+  // compute step: previous state in, next state out
+  array<VkDescriptorSetLayoutBinding, 2> computeBindings{};
+  for (uint32_t i = 0; i < computeBindings.size(); i++) {
+    computeBindings[i] = {.binding = i,
+                          .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                          .descriptorCount = 1,
+                          .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT};
+  }
+
+  VkDescriptorSetLayoutCreateInfo computeLayoutInfo{
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(computeBindings.size()),
+      .pBindings = computeBindings.data(),
+  };
+
+  if (vkCreateDescriptorSetLayout(device, &computeLayoutInfo, nullptr, &computeDescriptorSetLayout) !=
+      VK_SUCCESS) {
+    throw runtime_error("failed to create compute descriptor set layout!");
+  }
+}
+
+void VulkanEngine::createComputePipeline() {
+  VkShaderModule computeShaderModule = createShaderModule(spirv::nbody, sizeof(spirv::nbody));
+
+  // local_size_x_id = 0, also the size of the shared tile
+  SpecializationConstants constants;
+  constants.set(0, workgroupSize);
+
+  VkPipelineShaderStageCreateInfo computeShaderStageInfo{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+      .module = computeShaderModule,
+      .pName = "main",
+      .pSpecializationInfo = constants.get(),
+  };
+
+  VkPushConstantRange simulationRange{
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT, .offset = 0, .size = sizeof(SimulationPushConstants)};
+
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                                                .setLayoutCount = 1,
+                                                .pSetLayouts = &computeDescriptorSetLayout,
+                                                .pushConstantRangeCount = 1,
+                                                .pPushConstantRanges = &simulationRange};
+
+  if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &computePipelineLayout) != VK_SUCCESS) {
+    throw runtime_error("failed to create compute pipeline layout!");
+  }
+
+  VkComputePipelineCreateInfo pipelineInfo{
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage = computeShaderStageInfo,
+      .layout = computePipelineLayout,
+  };
+
+  auto compileStart = chrono::steady_clock::now();
+  if (vkCreateComputePipelines(device, pipelineCache.get(), 1, &pipelineInfo, nullptr, &computePipeline) !=
+      VK_SUCCESS) {
+    throw runtime_error("failed to create compute pipeline!");
+  }
+  pipelineCache.recordCompile(compileStart);
+
+  vkDestroyShaderModule(device, computeShaderModule, nullptr);
+}
+
+void VulkanEngine::createParticleBuffers() {
+  // the cull pass always binds a particle buffer, keep one element around even without a simulation
+  vector<GpuParticle> initial(max<size_t>(particles.size(), 1), GpuParticle{});
+  for (size_t i = 0; i < particles.size(); i++) {
+    initial[i] = {.position = {particles.x[i], particles.y[i]},
+                  .velocity = {particles.vx[i], particles.vy[i]},
+                  .mass = particles.mass[i]};
+  }
+
+  VkDeviceSize bufferSize = sizeof(GpuParticle) * initial.size();
+
+  // written on the compute queue, read on the graphics queue, filled from the transfer queue
+  QueueFamilyIndices indices = findSuitableQueueFamiles(physicalDevice);
+  vector<uint32_t> families = {indices.graphicsFamily.value(), indices.computeFamily.value(),
+                               indices.transferFamily.value()};
+
+  particleBuffers.resize(max_inflight_frames);
+  particleMemory.resize(max_inflight_frames);
+
+  for (size_t i = 0; i < particleBuffers.size(); i++) {
+    createBuffer(bufferSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, particleBuffers[i], particleMemory[i], allocator,
+                 families);
+    staging.uploadBuffer(initial.data(), bufferSize, particleBuffers[i], 0, true);
+  }
+
+  // the compute queue reads these first and the staging barrier does not reach across queues
+  staging.wait(staging.submit());
+}
+
+void VulkanEngine::createDescriptorSets() {
+  uint32_t frames = static_cast<uint32_t>(max_inflight_frames);
+
+  VkDescriptorPoolSize poolSize{.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 2 * frames};
+
+  VkDescriptorPoolCreateInfo poolInfo{
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = frames,
+      .poolSizeCount = 1,
+      .pPoolSizes = &poolSize,
+  };
+
+  if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS) {
+    throw runtime_error("failed to create descriptor pool!");
+  }
+
+  vector<VkDescriptorSetLayout> computeLayouts(frames, computeDescriptorSetLayout);
+  computeDescriptorSets.resize(frames);
+
+  VkDescriptorSetAllocateInfo computeAllocInfo{
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = descriptorPool,
+      .descriptorSetCount = frames,
+      .pSetLayouts = computeLayouts.data(),
+  };
+
+  if (vkAllocateDescriptorSets(device, &computeAllocInfo, computeDescriptorSets.data()) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate descriptor sets!");
+  }
+
+  for (uint32_t i = 0; i < frames; i++) {
+    VkDescriptorBufferInfo previousState{
+        .buffer = particleBuffers[(i + frames - 1) % frames], .offset = 0, .range = VK_WHOLE_SIZE};
+    VkDescriptorBufferInfo nextState{.buffer = particleBuffers[i], .offset = 0, .range = VK_WHOLE_SIZE};
+
+    array<VkWriteDescriptorSet, 2> writes{};
+    writes[0] = {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                 .dstSet = computeDescriptorSets[i],
+                 .dstBinding = 0,
+                 .descriptorCount = 1,
+                 .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                 .pBufferInfo = &previousState};
+    writes[1] = {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                 .dstSet = computeDescriptorSets[i],
+                 .dstBinding = 1,
+                 .descriptorCount = 1,
+                 .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                 .pBufferInfo = &nextState};
+
+    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  }
+}
+
+void VulkanEngine::recordComputeCommandBuffer(VkCommandBuffer commandBuffer, uint32_t frame) {
+  VkCommandBufferBeginInfo beginInfo{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+
+  if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+    throw runtime_error("failed to begin recording compute command buffer!");
+  }
+
+  // the previous step was submitted to this queue, its writes have to land before we read them
+  VkMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+  };
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineLayout, 0, 1,
+                          &computeDescriptorSets[frame], 0, nullptr);
+
+  SimulationPushConstants simulationConstants{
+      .dt = simulationDt,
+      .G = solver.G,
+      .softening = solver.softening,
+      .count = static_cast<uint32_t>(particles.size()),
+  };
+  vkCmdPushConstants(commandBuffer, computePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                     sizeof(simulationConstants), &simulationConstants);
+
+  vkCmdDispatch(commandBuffer, (simulationConstants.count + workgroupSize - 1) / workgroupSize, 1, 1);
+
+  if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+    throw runtime_error("failed to record compute command buffer!");
+  }
+}
+
+// called after the frame's fence wait, so the compute buffer and the slot's particle buffer are free
+VkSemaphore VulkanEngine::submitComputeStep(uint32_t frame) {
+  vkResetCommandBuffer(computeCommandBuffers[frame], 0);
+  recordComputeCommandBuffer(computeCommandBuffers[frame], frame);
+
+  VkSubmitInfo submitInfo{
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &computeCommandBuffers[frame],
+      .signalSemaphoreCount = 1,
+      .pSignalSemaphores = &computeFinishedSemaphores[frame],
+  };
+
+  if (vkQueueSubmit(computeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+    throw runtime_error("failed to submit compute command buffer!");
+  }
+
+  return computeFinishedSemaphores[frame];
+}
+
+void VulkanEngine::cleanupCompute() {
+  vkDestroyCommandPool(device, computeCommandPool, nullptr);
+
+  vkDestroyPipeline(device, computePipeline, nullptr);
+  vkDestroyPipelineLayout(device, computePipelineLayout, nullptr);
+
+  vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+  vkDestroyDescriptorSetLayout(device, computeDescriptorSetLayout, nullptr);
+
+  for (size_t i = 0; i < particleBuffers.size(); i++) {
+    destroyBuffer(particleBuffers[i], particleMemory[i], allocator);
+  }
+}
@@ -0,0 +1,318 @@
+#include "engine.h"
+#include "spirv.h"
+#include <algorithm>
+#include <vulkan/vulkan_core.h>
+
+using namespace std;
+
+// invocations per workgroup of cull.comp, one body each
+static const uint32_t cullWorkgroupSize = 64;
+
+// particles, instances, meshes, buckets, counters, placements, visible, commands
+static const uint32_t cullBindingCount = 8;
+
+// one mesh entry per geometry with bodies, one bucket per LOD level, in instance buffer order. rebuilt when
+// the scene version moves, the frame slots pick the new tables up in refreshCullFrame
+void VulkanEngine::buildCullTables() {
+  cullMeshes.clear();
+  cullBuckets.clear();
+  drawList.clear();
+  const SlotMap<RigidBody> &geometries = rigidBodyManager.geometries;
+  for (size_t i = 0; i < geometries.size(); i++) {
+    const RigidBody &rb = geometries.valueAt(i);
+    if (rb.instances.empty())
+      continue;
+
+    const Mesh &shape = rigidBodyManager.meshes[rb.mesh];
+    uint32_t mesh = static_cast<uint32_t>(cullMeshes.size());
+    // firstIndex counts from the start of the mesh's index section, which is where the draws bind it
+    bool narrow = rb.indexType == VK_INDEX_TYPE_UINT16;
+    uint32_t firstIndex = narrow ? static_cast<uint32_t>(rb.indexOffset / sizeof(uint16_t))
+                                 : static_cast<uint32_t>((rb.indexOffset - rigidBodyManager.index32Offset) /
+                                                         sizeof(uint32_t));
+    int32_t vertexOffset = static_cast<int32_t>(rb.vertexOffset / Vertex::stride(vertexLayout));
+
+    // the GPU simulation owns the circle centers
+    cullMeshes.push_back({.firstBody = static_cast<uint32_t>(rb.instanceOffset / sizeof(Instance)),
+                          .bodyCount = static_cast<uint32_t>(rb.instances.size()),
+                          .firstBucket = static_cast<uint32_t>(cullBuckets.size()),
+                          .particleCenters = simulation == SimulationBackend::Gpu &&
+                                             geometries.handleAt(i) == circleGeometry,
+                          .color = {rb.color.r, rb.color.g, rb.color.b}});
+
+    // a single tessellation is one bucket that every visible body lands in
+    if (shape.lods.empty()) {
+      cullBuckets.push_back({.indexCount = static_cast<uint32_t>(shape.indices.size()),
+                             .firstIndex = firstIndex,
+                             .vertexOffset = vertexOffset,
+                             .segments = UINT32_MAX,
+                             .mesh = mesh});
+    }
+    for (const LodLevel &lod : shape.lods) {
+      cullBuckets.push_back({.indexCount = lod.indexCount,
+                             .firstIndex = firstIndex + lod.firstIndex,
+                             .vertexOffset = vertexOffset + lod.vertexOffset,
+                             .segments = lod.segments,
+                             .mesh = mesh});
+    }
+
+    CullMesh &entry = cullMeshes.back();
+    entry.bucketCount = static_cast<uint32_t>(cullBuckets.size()) - entry.firstBucket;
+    drawList.push_back({.mesh = mesh,
+                        .firstBucket = entry.firstBucket,
+                        .bucketCount = entry.bucketCount,
+                        .indexType = rb.indexType});
+  }
+  cullBodyCount = cullMeshes.empty() ? 0 : cullMeshes.back().firstBody + cullMeshes.back().bodyCount;
+  cullTablesVersion = rigidBodyManager.sceneVersion;
+}
+
+void VulkanEngine::createCullResources() {
+  array<VkDescriptorSetLayoutBinding, cullBindingCount> bindings{};
+  for (uint32_t i = 0; i < bindings.size(); i++) {
+    bindings[i] = {.binding = i,
+                   .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                   .descriptorCount = 1,
+                   .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT};
+  }
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo{
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(bindings.size()),
+      .pBindings = bindings.data(),
+  };
+
+  if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &cullDescriptorSetLayout) != VK_SUCCESS) {
+    throw runtime_error("failed to create cull descriptor set layout!");
+  }
+
+  uint32_t frames = static_cast<uint32_t>(max_inflight_frames);
+  VkDescriptorPoolSize poolSize{.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                .descriptorCount = cullBindingCount * frames};
+
+  VkDescriptorPoolCreateInfo poolInfo{
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = frames,
+      .poolSizeCount = 1,
+      .pPoolSizes = &poolSize,
+  };
+
+  if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &cullDescriptorPool) != VK_SUCCESS) {
+    throw runtime_error("failed to create cull descriptor pool!");
+  }
+
+  buildCullTables();
+
+  cullFrames.resize(max_inflight_frames);
+  for (uint32_t i = 0; i < frames; i++) {
+    VkDescriptorSetAllocateInfo allocInfo{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = cullDescriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &cullDescriptorSetLayout,
+    };
+
+    if (vkAllocateDescriptorSets(device, &allocInfo, &cullFrames[i].descriptorSet) != VK_SUCCESS) {
+      throw runtime_error("failed to allocate cull descriptor sets!");
+    }
+
+    createCullFrame(i);
+  }
+
+  createCullPipeline();
+}
+
+// the slot's copy of the tables and its output buffers, sized for every body being visible so nothing is
+// read back. the descriptor set is rewritten to match
+void VulkanEngine::createCullFrame(uint32_t slot) {
+  CullFrame &frame = cullFrames[slot];
+
+  // small and written once per scene, the cull pass reads them straight from host memory
+  VkDeviceSize meshSize = max<VkDeviceSize>(sizeof(CullMesh) * cullMeshes.size(), sizeof(CullMesh));
+  VkDeviceSize bucketSize = max<VkDeviceSize>(sizeof(CullBucket) * cullBuckets.size(), sizeof(CullBucket));
+  createBuffer(meshSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, frame.meshes,
+               frame.meshMemory, allocator);
+  createBuffer(bucketSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, frame.buckets,
+               frame.bucketMemory, allocator);
+  memcpy(frame.meshMemory.mapped, cullMeshes.data(), sizeof(CullMesh) * cullMeshes.size());
+  memcpy(frame.bucketMemory.mapped, cullBuckets.data(), sizeof(CullBucket) * cullBuckets.size());
+
+  uint32_t bodies = max(cullBodyCount, 1u);
+  uint32_t buckets = max(static_cast<uint32_t>(cullBuckets.size()), 1u);
+  VkDeviceSize counterSize = sizeof(uint32_t) * (cullMeshes.size() + 2 * buckets);
+
+  createBuffer(counterSize,
+               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                   VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frame.counters, frame.counterMemory, allocator);
+  createBuffer(2 * sizeof(uint32_t) * bodies, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frame.placements, frame.placementMemory, allocator);
+  createBuffer(sizeof(Instance) * bodies,
+               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frame.visible, frame.visibleMemory, allocator);
+  createBuffer(sizeof(VkDrawIndexedIndirectCommand) * buckets,
+               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frame.commands, frame.commandMemory, allocator);
+
+  // the particles this frame's compute step writes and the instances syncInstances fills for this slot
+  array<VkBuffer, cullBindingCount> buffers = {particleBuffers[slot], rigidBodyManager.instanceBuffers[slot],
+                                               frame.meshes,          frame.buckets,
+                                               frame.counters,        frame.placements,
+                                               frame.visible,         frame.commands};
+
+  array<VkDescriptorBufferInfo, cullBindingCount> bufferInfos{};
+  array<VkWriteDescriptorSet, cullBindingCount> writes{};
+  for (uint32_t b = 0; b < cullBindingCount; b++) {
+    bufferInfos[b] = {.buffer = buffers[b], .offset = 0, .range = VK_WHOLE_SIZE};
+    writes[b] = {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                 .dstSet = frame.descriptorSet,
+                 .dstBinding = b,
+                 .descriptorCount = 1,
+                 .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                 .pBufferInfo = &bufferInfos[b]};
+  }
+
+  vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  frame.sceneVersion = cullTablesVersion;
+}
+
+void VulkanEngine::destroyCullFrame(uint32_t slot) {
+  CullFrame &frame = cullFrames[slot];
+  destroyBuffer(frame.meshes, frame.meshMemory, allocator);
+  destroyBuffer(frame.buckets, frame.bucketMemory, allocator);
+  destroyBuffer(frame.counters, frame.counterMemory, allocator);
+  destroyBuffer(frame.placements, frame.placementMemory, allocator);
+  destroyBuffer(frame.visible, frame.visibleMemory, allocator);
+  destroyBuffer(frame.commands, frame.commandMemory, allocator);
+}
+
+// the slot's fence has signalled, so no cull pass or draw in flight still reads its buffers or descriptor
+// set. the other slots keep theirs until their own turn
+void VulkanEngine::refreshCullFrame(uint32_t slot) {
+  if (cullTablesVersion != rigidBodyManager.sceneVersion)
+    buildCullTables();
+  if (cullFrames[slot].sceneVersion == cullTablesVersion)
+    return;
+
+  destroyCullFrame(slot);
+  createCullFrame(slot);
+}
+
+void VulkanEngine::createCullPipeline() {
+  VkShaderModule cullShaderModule = createShaderModule(spirv::cull, sizeof(spirv::cull));
+
+  SpecializationConstants constants;
+  constants.set(0, cullWorkgroupSize);
+
+  VkPipelineShaderStageCreateInfo cullShaderStageInfo{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+      .module = cullShaderModule,
+      .pName = "main",
+      .pSpecializationInfo = constants.get(),
+  };
+
+  VkPushConstantRange cullRange{
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT, .offset = 0, .size = sizeof(CullPushConstants)};
+
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                                                .setLayoutCount = 1,
+                                                .pSetLayouts = &cullDescriptorSetLayout,
+                                                .pushConstantRangeCount = 1,
+                                                .pPushConstantRanges = &cullRange};
+
+  if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &cullPipelineLayout) != VK_SUCCESS) {
+    throw runtime_error("failed to create cull pipeline layout!");
+  }
+
+  VkComputePipelineCreateInfo pipelineInfo{
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage = cullShaderStageInfo,
+      .layout = cullPipelineLayout,
+  };
+
+  auto compileStart = chrono::steady_clock::now();
+  if (vkCreateComputePipelines(device, pipelineCache.get(), 1, &pipelineInfo, nullptr, &cullPipeline) !=
+      VK_SUCCESS) {
+    throw runtime_error("failed to create cull pipeline!");
+  }
+  pipelineCache.recordCompile(compileStart);
+
+  vkDestroyShaderModule(device, cullShaderModule, nullptr);
+}
+
+// recorded into the frame's primary ahead of the scene pass, the draws read what the last pass writes
+void VulkanEngine::recordCulling(VkCommandBuffer commandBuffer, uint32_t frame) {
+  if (cullBodyCount == 0)
+    return;
+
+  const CullFrame &target = cullFrames[frame];
+
+  // the atomics count up from zero, the draw counts included
+  vkCmdFillBuffer(commandBuffer, target.counters, 0, VK_WHOLE_SIZE, 0);
+
+  VkMemoryBarrier cleared{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+  };
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                       1, &cleared, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1,
+                          &target.descriptorSet, 0, nullptr);
+
+  // NDC to pixels, take the larger axis so we never under-tessellate
+  CullPushConstants cull{
+      .zoom = zoom,
+      .pixelsPerUnit = 0.5f * max(swapChainExtent.width, swapChainExtent.height) * zoom,
+      .maxErrorPixels = lodMaxError,
+      .bodyCount = cullBodyCount,
+      .meshCount = static_cast<uint32_t>(cullMeshes.size()),
+      .bucketCount = static_cast<uint32_t>(cullBuckets.size()),
+  };
+  uint32_t groups = (cullBodyCount + cullWorkgroupSize - 1) / cullWorkgroupSize;
+
+  VkMemoryBarrier passDone{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+  };
+
+  // count per bucket, then one invocation turns the counts into draws, then every body finds its slot
+  for (uint32_t pass = 0; pass < 3; pass++) {
+    if (pass > 0) {
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &passDone, 0, nullptr, 0, nullptr);
+    }
+
+    cull.pass = pass;
+    vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(cull),
+                       &cull);
+    vkCmdDispatch(commandBuffer, pass == 1 ? 1 : groups, 1, 1);
+  }
+
+  VkMemoryBarrier culled{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
+  };
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1,
+                       &culled, 0, nullptr, 0, nullptr);
+}
+
+void VulkanEngine::cleanupCulling() {
+  vkDestroyPipeline(device, cullPipeline, nullptr);
+  vkDestroyPipelineLayout(device, cullPipelineLayout, nullptr);
+  vkDestroyDescriptorPool(device, cullDescriptorPool, nullptr);
+  vkDestroyDescriptorSetLayout(device, cullDescriptorSetLayout, nullptr);
+
+  for (uint32_t i = 0; i < cullFrames.size(); i++) {
+    destroyCullFrame(i);
+  }
+  cullFrames.clear();
+}
@@ -34,6 +34,13 @@ VulkanEngine::getAvailableDevices() {
   return availableDevices;
 }
 
+vector<const char *> VulkanEngine::getRequiredDeviceExtensions() {
+  // nothing is presented in headless mode, so the swapchain extension is optional
+  if (headless)
+    return {};
+  return deviceExtensions;
+}
+
 bool VulkanEngine::checkDeviceExtensionSupport(VkPhysicalDevice device) {
   uint32_t extensionCount;
   vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
@@ -41,7 +48,8 @@ bool VulkanEngine::checkDeviceExtensionSupport(VkPhysicalDevice device) {
   std::vector<VkExtensionProperties> availableExtensions(extensionCount);
   vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-  set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+  auto required = getRequiredDeviceExtensions();
+  set<std::string> requiredExtensions(required.begin(), required.end());
 
   for (const auto &extension : availableExtensions) {
     requiredExtensions.erase(extension.extensionName);
@@ -50,6 +58,24 @@ bool VulkanEngine::checkDeviceExtensionSupport(VkPhysicalDevice device) {
   return requiredExtensions.empty();
 }
 
+bool VulkanEngine::checkFeatureSupport(VkPhysicalDevice device) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device, &properties);
+  if (properties.apiVersion < VK_API_VERSION_1_2)
+    return false;
+
+  VkPhysicalDeviceVulkan12Features features12{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES};
+  VkPhysicalDeviceFeatures2 features{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &features12,
+  };
+  vkGetPhysicalDeviceFeatures2(device, &features);
+
+  // the culled draws start at a nonzero instance and a mesh has several of them per call
+  return features12.timelineSemaphore && features12.drawIndirectCount &&
+         features.features.multiDrawIndirect && features.features.drawIndirectFirstInstance;
+}
+
 QueueFamilyIndices VulkanEngine::findSuitableQueueFamiles(VkPhysicalDevice device) {
   QueueFamilyIndices indices;
 
@@ -59,45 +85,72 @@ QueueFamilyIndices VulkanEngine::findSuitableQueueFamiles(VkPhysicalDevice devic
   vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
   vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
 
+  bool asyncCompute = false;
+  bool dedicatedTransfer = false;
   for (int i = 0; i < queueFamilies.size(); i++) {
 
-    // check if queue can process graphics
-    if (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT && !indices.graphicsFamily.has_value())
+    // check if queue can process graphics, the cull pass dispatches on it too
+    VkQueueFlags graphicsCompute = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+    if ((queueFamilies[i].queueFlags & graphicsCompute) == graphicsCompute &&
+        !indices.graphicsFamily.has_value())
       indices.graphicsFamily = i;
 
+    // any compute family will do, but one without graphics runs alongside rasterization
+    if (queueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT) {
+      bool dedicated = !(queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT);
+      if (!indices.computeFamily.has_value() || (dedicated && !asyncCompute)) {
+        indices.computeFamily = i;
+        asyncCompute = dedicated;
+      }
+    }
+
+    // a family that only copies usually maps to the DMA engines
+    VkQueueFlags flags = queueFamilies[i].queueFlags;
+    if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+        !dedicatedTransfer) {
+      indices.transferFamily = i;
+      dedicatedTransfer = true;
+    }
+
     VkBool32 presentationSupport = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentationSupport);
+    if (!headless)
+      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentationSupport);
 
     // check if queue can process presentation commands
     if (presentationSupport && !indices.presentFamily.has_value())
       indices.presentFamily = i;
 
-    if (indices.isComplete())
+    if (indices.isComplete() && asyncCompute && dedicatedTransfer)
       break;
   }
+
+  // graphics families take transfer commands too
+  if (!dedicatedTransfer)
+    indices.transferFamily = indices.graphicsFamily;
+
+  // there is no surface to present to, alias the graphics family so queue setup stays uniform
+  if (headless)
+    indices.presentFamily = indices.graphicsFamily;
+
   return indices;
 }
 
 vector<VkDeviceQueueCreateInfo> VulkanEngine::buildQueueCreateInfos(QueueFamilyIndices indices) {
 
-  float *queuePriority = new float(1.0f);
-  VkDeviceQueueCreateInfo graphicsInfo{.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                                       .queueFamilyIndex = indices.graphicsFamily.value(),
-                                       .queueCount = 1,
-                                       .pQueuePriorities = queuePriority};
+  static const float queuePriority = 1.0f;
 
-  vector<VkDeviceQueueCreateInfo> infos = {graphicsInfo};
+  // one queue per distinct family
+  set<uint32_t> families = {indices.graphicsFamily.value(), indices.presentFamily.value(),
+                            indices.computeFamily.value(), indices.transferFamily.value()};
 
-  if (indices.graphicsFamily.value() == indices.presentFamily.value()) {
-    return infos;
+  vector<VkDeviceQueueCreateInfo> infos;
+  for (uint32_t family : families) {
+    infos.push_back({.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+                     .queueFamilyIndex = family,
+                     .queueCount = 1,
+                     .pQueuePriorities = &queuePriority});
   }
 
-  VkDeviceQueueCreateInfo presentInfo{.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                                      .queueFamilyIndex = indices.presentFamily.value(),
-                                      .queueCount = 1,
-                                      .pQueuePriorities = queuePriority};
-  infos.push_back(presentInfo);
-
   return infos;
 }
 
@@ -147,11 +200,14 @@ VulkanEngine::pickPhysicalDevice(optional<std::vector<const char *>> validationL
     QueueFamilyIndices indices = findSuitableQueueFamiles(get<0>(dev));
 
     // check swap chain support
-    SwapChainSupportDetails swapChainSupport = querySwapChainSupport(&get<0>(dev));
-    bool swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
+    bool swapChainAdequate = true;
+    if (!headless) {
+      SwapChainSupportDetails swapChainSupport = querySwapChainSupport(&get<0>(dev));
+      swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
+    }
 
     if (!get<2>(dev).geometryShader || !indices.isComplete() || !checkDeviceExtensionSupport(get<0>(dev)) ||
-        !swapChainAdequate) {
+        !checkFeatureSupport(get<0>(dev)) || !swapChainAdequate) {
       score = 0;
     }
 
@@ -174,14 +230,27 @@ VulkanEngine::pickPhysicalDevice(optional<std::vector<const char *>> validationL
 
   auto queueInfos = buildQueueCreateInfos(indices);
 
-  VkPhysicalDeviceFeatures deviceFeatures{};
+  auto extensions = getRequiredDeviceExtensions();
+
+  VkPhysicalDeviceFeatures deviceFeatures{
+      .multiDrawIndirect = VK_TRUE,
+      .drawIndirectFirstInstance = VK_TRUE,
+  };
+  // the staging ring signals a timeline semaphore, uploads are waited on by value. the cull pass writes the
+  // draw counts
+  VkPhysicalDeviceVulkan12Features features12{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+      .drawIndirectCount = VK_TRUE,
+      .timelineSemaphore = VK_TRUE,
+  };
   VkDeviceCreateInfo deviceCreateInfo{
       .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+      .pNext = &features12,
       .queueCreateInfoCount = static_cast<uint32_t>(queueInfos.size()),
       .pQueueCreateInfos = queueInfos.data(),
       .enabledLayerCount = 0,
-      .enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size()),
-      .ppEnabledExtensionNames = deviceExtensions.data(),
+      .enabledExtensionCount = static_cast<uint32_t>(extensions.size()),
+      .ppEnabledExtensionNames = extensions.data(),
       .pEnabledFeatures = &deviceFeatures,
   };
 
@@ -199,10 +268,14 @@ VulkanEngine::pickPhysicalDevice(optional<std::vector<const char *>> validationL
 
   vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &queues.graphicsQueue);
   vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &queues.presentQueue);
-
-  // TODO free allocated floats
+  vkGetDeviceQueue(device, indices.computeFamily.value(), 0, &queues.computeQueue);
+  vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &queues.transferQueue);
 
   cout << "Selected device: " << selectedDeviceProps.deviceName << endl;
+  cout << "Compute family: " << indices.computeFamily.value()
+       << (indices.computeFamily != indices.graphicsFamily ? " (async)" : "") << endl;
+  cout << "Transfer family: " << indices.transferFamily.value()
+       << (indices.transferFamily != indices.graphicsFamily ? " (dedicated)" : "") << endl;
 
   return tuple<VkDevice, VkPhysicalDevice, QueueFamilies>(device, selectedDevice, queues);
 }
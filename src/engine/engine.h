@@ -10,75 +10,458 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <glm/glm.hpp>
 #include <iostream>
 #include <math.h>
+#include <memory>
 #include <optional>
 #include <string>
+#include <thread>
+#include <tuple>
+
+#include "buddy.h"
+#include "geodesic.h"
+#include "nbody.h"
+#include "profiler.h"
+#include "slot_map.h"
+#include "triple_buffer.h"
 
 const float PI = 3.141592653;
 struct RigidBody;
+struct Mesh;
 class VulkanEngine;
 
+// a range of a DeviceAllocator block, or a whole dedicated allocation
+struct Allocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0, size = 0;
+  // host-visible memory is mapped once per block and stays mapped
+  void *mapped = nullptr;
+
+  // pool and block it came from, the block is unused for dedicated allocations
+  uint32_t pool = 0, block = 0;
+  bool dedicated = false;
+};
+
+// a buffer replaced while frames in flight may still read it, destroyed once they have finished
+struct RetiredBuffer {
+  VkBuffer buffer;
+  Allocation memory;
+  // VulkanEngine::submittedFrames at the time, the frames before it may still use the buffer
+  uint64_t retiredAt;
+};
+
+// how mesh vertices sit in the vertex buffer. Float is 20 bytes a vertex, the compact layouts 8: half or
+// 16-bit normalized positions plus R8G8B8A8_UNORM colors. Snorm16 needs the meshes inside [-1, 1], which
+// the unit scale meshes are
+enum class VertexLayout { Float, Half, Snorm16 };
+
 class RigidBodyManager {
 private:
   VulkanEngine *engine;
 
-  std::pair<VkDeviceSize, VkDeviceSize> getSizes();
-  void calculateOffsets();
+  // sceneVersion the offsets were calculated for, and how many meshes the vertex and index buffers hold
+  uint64_t layoutVersion = UINT64_MAX;
+  size_t uploadedMeshes = 0;
+  // the vertex and index buffers replaced by a re-upload, oldest first
+  std::deque<RetiredBuffer> retiredBuffers;
+  // sceneVersion each frame's instance copy was sized for
+  std::vector<uint64_t> instanceLayouts;
+
+  void uploadMeshes();
+  void createInstanceBuffer(uint32_t frame);
+  void releaseRetiredBuffers(bool all);
 
 public:
+  // host-side packing, public for the benchmarks which run them without a device. getSizes reads the
+  // index offsets, so calculateOffsets goes first
+  std::tuple<VkDeviceSize, VkDeviceSize, VkDeviceSize> getSizes();
+  void calculateOffsets();
+  // copies every mesh to its offset, the staging data loadToGpu uploads
+  void packMeshes(std::vector<uint8_t> &vertexData, std::vector<uint8_t> &indexData);
+
   VkBuffer vertexBuffer, indexBuffer;
-  VkDeviceMemory vertexMemory, indexMemory;
-  std::unordered_map<std::string, RigidBody> geometries;
+  Allocation vertexMemory, indexMemory;
+  // set before loadToGpu, the graphics pipeline has to use the same
+  VertexLayout vertexLayout = VertexLayout::Snorm16;
+  // the index buffer holds the 16-bit meshes first and the 32-bit ones from here
+  VkDeviceSize index32Offset = 0;
+
+  // instances move every frame once bodies are simulated, so each frame in flight gets its own
+  // persistently mapped copy that is rewritten only when its version falls behind
+  std::vector<VkBuffer> instanceBuffers;
+  std::vector<Allocation> instanceMemory;
+  std::vector<uint64_t> instanceVersions;
+  uint64_t instanceVersion = 0;
+  // bumped when meshes or instance counts change, which the recorded draws bake in
+  uint64_t sceneVersion = 0;
+  // bytes syncInstances has written to the instance copies so far
+  uint64_t syncedBytes = 0;
+
+  // each a shared mesh plus its own instances, packed densely so the per-frame walks are linear. add and
+  // remove them through addGeometry and removeGeometry, which are O(1) on the host. once loaded, the GPU
+  // copies are laid out again by the next syncInstances of every frame slot
+  SlotMap<RigidBody> geometries;
+  // optional names, only looked up at setup, indexed by handle slot
+  std::unordered_map<std::string, SlotHandle> geometryNames;
+  std::vector<std::string> slotNames;
+  // every distinct vertex/index payload once, geometries refer to them by index
+  std::vector<Mesh> meshes;
+  // content hash to the meshes with that hash, more than one only on a collision
+  std::unordered_multimap<uint64_t, uint32_t> meshesByHash;
+
+  // hashes the body's mesh and moves it into meshes, unless an identical one is there already. adding
+  // under a name that is taken replaces that geometry and keeps its handle
+  SlotHandle addGeometry(RigidBody body, const std::string &name = "");
+  // the mesh stays, other geometries may share it
+  void removeGeometry(SlotHandle handle);
+  // a stale handle when there is no such name
+  SlotHandle findGeometry(const std::string &name) const;
+
   RigidBodyManager(VulkanEngine *engine);
   ~RigidBodyManager();
   void loadToGpu();
+  void cleanup();
+  void markInstancesDirty() { instanceVersion++; }
+  // after adding or removing bodies, moving them only needs markInstancesDirty
+  void markSceneDirty() { sceneVersion++; }
+  // brings this frame's instance copy up to date, after a scene change it first lays the buffers out again
+  void syncInstances(uint32_t frame);
+};
+
+// buffers and linear images must not share a page with optimal images (bufferImageGranularity), so each
+// tiling gets its own blocks
+enum class ResourceTiling { Linear, Optimal };
+
+struct AllocatorStats {
+  uint32_t blocks = 0, allocations = 0, dedicatedAllocations = 0;
+  // device memory held, bytes handed out (rounded to buddy blocks) and bytes asked for
+  VkDeviceSize reserved = 0, used = 0, requested = 0;
+  // 1 - largest free range / all free bytes, over the sub-allocated blocks
+  float fragmentation = 0.0f;
 };
 
+// grabs large blocks of device memory per memory type and tiling and sub-allocates them with a buddy
+// allocator, keeping the vkAllocateMemory count far below maxMemoryAllocationCount
+class DeviceAllocator {
+private:
+  struct Block {
+    VkDeviceMemory memory;
+    void *mapped;
+    BuddyAllocator buddy;
+  };
+
+  struct Pool {
+    uint32_t memoryType;
+    VkDeviceSize blockSize;
+    std::vector<std::unique_ptr<Block>> blocks;
+  };
+
+  VkDevice device;
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  // indexed by 2 * memory type + tiling
+  std::vector<Pool> pools;
+  uint32_t dedicatedCount = 0;
+  VkDeviceSize dedicatedBytes = 0, requestedBytes = 0;
+
+  VkDeviceMemory allocateMemory(uint32_t memoryType, VkDeviceSize size, void **mapped);
+
+public:
+  void create(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize = 64 * 1024 * 1024);
+  void destroy();
+
+  VkDevice getDevice() const { return device; }
+  uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const;
+
+  // requests of half a block or more get their own VkDeviceMemory
+  Allocation allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags properties,
+                      ResourceTiling tiling);
+  void free(Allocation &allocation);
+
+  AllocatorStats stats() const;
+};
+
+// buffers shared by more than one queue family are created VK_SHARING_MODE_CONCURRENT
 void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
-                  VkBuffer &buffer, VkDeviceMemory &bufferMemory, VkDeviceSize offset, VkDevice *device,
-                  VkPhysicalDevice *physDevice);
+                  VkBuffer &buffer, Allocation &allocation, DeviceAllocator &allocator,
+                  const std::vector<uint32_t> &queueFamilies = {});
+void destroyBuffer(VkBuffer buffer, Allocation &allocation, DeviceAllocator &allocator);
+
+// persistently mapped upload buffer shared by every host to device copy. uploads are carved out of it in
+// order and recorded into a recycled command buffer per batch, and a batch's space is reused once the
+// timeline semaphore reaches its ticket. every batch ends with a transfer to all-commands barrier, so later
+// work on the same queue sees the copies without waiting on the host
+class StagingRing {
+private:
+  struct Batch {
+    VkCommandBuffer commandBuffer;
+    // ring bytes the batch holds, alignment and wrap padding included
+    VkDeviceSize size;
+    // timeline value the batch signals when it completes
+    uint64_t ticket;
+  };
 
-uint32_t findMemoryType(VkPhysicalDevice *device, uint32_t typeFilter, VkMemoryPropertyFlags properties);
+  VkDevice device;
+  DeviceAllocator *allocator;
+  VkQueue queue;
+  uint32_t family, consumerFamily;
+  VkCommandPool commandPool;
+  VkSemaphore timeline;
+  VkBuffer buffer;
+  Allocation memory;
+  uint8_t *mapped;
+  VkDeviceSize capacity;
+  VkDeviceSize head = 0, used = 0;
+  // everything ever staged, for the perf report
+  VkDeviceSize stagedBytes = 0;
+
+  std::optional<Batch> recording;
+  std::deque<Batch> inFlight;
+  std::vector<Batch> idle;
+  uint64_t nextTicket = 1, completedTicket = 0;
+
+  // consumer halves of ownership transfers, tagged with the ticket of the batch holding the release
+  std::vector<std::pair<uint64_t, VkBufferMemoryBarrier>> bufferAcquires;
+  std::vector<std::pair<uint64_t, VkImageMemoryBarrier>> imageAcquires;
+
+  Batch &open();
+  bool retireOldest(bool wait);
+  bool transfersOwnership() const { return family != consumerFamily; }
 
-// shader vertex inputs
+public:
+  // the stages that read uploads on the consumer queue, waited on by acquire() and the frame submit
+  static constexpr VkPipelineStageFlags consumerStages =
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+  // batches run on queue, a dedicated transfer queue hands what it writes over to consumerFamily
+  void create(DeviceAllocator &allocator, VkQueue queue, uint32_t family, uint32_t consumerFamily,
+              VkDeviceSize capacity);
+  void destroy();
+
+  // copies data into the ring and returns its offset in getBuffer(). a full ring submits the open batch
+  // and waits for the oldest ones, so fetch commandBuffer() only after staging
+  VkDeviceSize stage(const void *data, VkDeviceSize size, VkDeviceSize alignment = 16);
+  VkCommandBuffer commandBuffer();
+  VkBuffer getBuffer() const { return buffer; }
+  VkSemaphore getTimeline() const { return timeline; }
+  VkDeviceSize getStagedBytes() const { return stagedBytes; }
+
+  // copies larger than the ring are split across batches. shared buffers are concurrent across the
+  // transfer family already and skip the ownership transfer
+  void uploadBuffer(const void *data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset = 0,
+                    bool shared = false);
+  // moves an image written in the open batch to newLayout and hands it to the consumer family
+  void releaseImage(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout);
+
+  // closes the open batch and returns its timeline value for wait() or a queue wait
+  uint64_t submit();
+  void wait(uint64_t ticket);
+  // recycles the batches that have finished without blocking
+  void reclaim();
+
+  // records the acquire half of every submitted release into a consumer command buffer. returns the
+  // timeline value that submit has to wait for at consumerStages, 0 when nothing was acquired
+  uint64_t acquire(VkCommandBuffer commandBuffer);
+};
+
+// VkPipelineCache backed by a file, so later launches skip the driver's shader compiles. a file written by a
+// different driver or device is ignored and replaced at shutdown
+class PipelineCache {
+private:
+  VkDevice device;
+  VkPipelineCache cache = VK_NULL_HANDLE;
+  std::string path;
+  // why the file was not used, empty on a hit
+  std::string missReason;
+  size_t loadedSize = 0;
+  uint32_t pipelines = 0;
+  double compileSeconds = 0.0;
+
+public:
+  void create(VkDevice device, VkPhysicalDevice physicalDevice, const std::string &path);
+  // writes to a temporary file and renames it over the old one, so a concurrent reader never sees half a
+  // cache
+  void save();
+  void destroy();
+
+  VkPipelineCache get() const { return cache; }
+  // adds the time since start to the compile total
+  void recordCompile(std::chrono::steady_clock::time_point start);
+  void report() const;
+};
+
+// single mip, single layer 2D image in device-local memory
+void createImage(VkExtent2D extent, VkFormat format, VkImageUsageFlags usage, VkImage &image,
+                 Allocation &allocation, DeviceAllocator &allocator);
+void destroyImage(VkImage image, Allocation &allocation, DeviceAllocator &allocator);
+VkImageView createImageView(VkImage image, VkFormat format, VkDevice *device);
+
+// shader vertex inputs, meshes are built and hashed in this form and converted to the layout when packed
 struct Vertex {
   glm::vec2 pos;
   glm::vec3 color;
 
+  static uint32_t stride(VertexLayout layout);
+  static VkVertexInputBindingDescription getBindingDescription(VertexLayout layout);
+  static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions(VertexLayout layout);
+  // writes count vertices to dst, stride(layout) bytes each
+  static void pack(VertexLayout layout, const Vertex *vertices, size_t count, uint8_t *dst);
+};
+
+// per-instance inputs, a mesh is modelled around the origin at unit scale and placed by its instances
+struct Instance {
+  glm::vec2 center;
+  float radius;
+  glm::vec3 color;
+
   static VkVertexInputBindingDescription getBindingDescription() {
     VkVertexInputBindingDescription bindingDescription{
-        .binding = 0, .stride = sizeof(Vertex), .inputRate = VK_VERTEX_INPUT_RATE_VERTEX};
+        .binding = 1, .stride = sizeof(Instance), .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE};
 
     return bindingDescription;
   }
 
-  static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
-    std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
+  static std::array<VkVertexInputAttributeDescription, 3> getAttributeDescriptions() {
+    std::array<VkVertexInputAttributeDescription, 3> attributeDescriptions{};
 
     attributeDescriptions[0] = {
-        .location = 0, .binding = 0, .format = VK_FORMAT_R32G32_SFLOAT, .offset = offsetof(Vertex, pos)};
+        .location = 2, .binding = 1, .format = VK_FORMAT_R32G32_SFLOAT, .offset = offsetof(Instance, center)};
     attributeDescriptions[1] = {
-        .location = 1,
-        .binding = 0,
+        .location = 3, .binding = 1, .format = VK_FORMAT_R32_SFLOAT, .offset = offsetof(Instance, radius)};
+    attributeDescriptions[2] = {
+        .location = 4,
+        .binding = 1,
         .format = VK_FORMAT_R32G32B32_SFLOAT,
-        .offset = offsetof(Vertex, color),
+        .offset = offsetof(Instance, color),
     };
     return attributeDescriptions;
   }
 };
 
+// cull.comp tables, laid out to match its std430 structs. bodies are the instances of every mesh back to
+// back in instance buffer order
+struct CullMesh {
+  uint32_t firstBody, bodyCount;
+  // the mesh's LOD levels in the bucket table, coarsest first
+  uint32_t firstBucket, bucketCount;
+  // take the centers from the GPU simulation instead of the instance data
+  uint32_t particleCenters;
+  // RigidBody::color, applied to the instance colors
+  float color[3];
+};
+
+// one LOD level of one mesh, indices and vertices relative to the start of the shared buffers
+struct CullBucket {
+  uint32_t indexCount, firstIndex;
+  int32_t vertexOffset;
+  uint32_t segments, mesh;
+};
+
+struct CullPushConstants {
+  float zoom;
+  float pixelsPerUnit;
+  float maxErrorPixels;
+  uint32_t bodyCount, meshCount, bucketCount;
+  // 0 counts the visible bodies per bucket, 1 writes the draws, 2 scatters the instances
+  uint32_t pass;
+};
+
+// what cull.comp reads and writes for one frame in flight, read by that frame's draws
+struct CullFrame {
+  // this slot's copy of cullMeshes and cullBuckets
+  VkBuffer meshes, buckets;
+  Allocation meshMemory, bucketMemory;
+  // draw count per mesh, then instance count and first visible slot per bucket
+  VkBuffer counters;
+  // (bucket, slot) per body
+  VkBuffer placements;
+  // the visible bodies' instances in clip space, grouped by bucket
+  VkBuffer visible;
+  // a VkDrawIndexedIndirectCommand per bucket, the draws of a mesh packed from its first bucket
+  VkBuffer commands;
+  Allocation counterMemory, placementMemory, visibleMemory, commandMemory;
+  VkDescriptorSet descriptorSet;
+  // the rigid body scene version the buffers were sized and filled for
+  uint64_t sceneVersion;
+};
+
+// GPU simulation state, laid out to match the std430 Particle struct in nbody.comp
+struct GpuParticle {
+  glm::vec2 position;
+  glm::vec2 velocity;
+  float mass;
+  float padding[3];
+};
+
+struct SimulationPushConstants {
+  float dt;
+  float G;
+  float softening;
+  uint32_t count;
+};
+
+enum class SimulationBackend { None, Cpu, Gpu };
+
+// body positions of the last two CPU simulation steps, handed from the simulation thread to the render loop
+struct SimulationSnapshot {
+  std::vector<glm::vec2> previous, current;
+  // when current was published, the render loop reaches it one step period later
+  std::chrono::steady_clock::time_point published;
+};
+
+// full-screen lensing pass, distances in black hole masses. the table bounds are specialization constants
+struct LensingPushConstants {
+  float observerDistance;
+  float tanHalfFov;
+  float aspect;
+};
+
+// values for a shader's constant_id declarations, compiled into the pipeline instead of read at runtime
+class SpecializationConstants {
+private:
+  std::vector<VkSpecializationMapEntry> entries;
+  std::vector<uint8_t> data;
+  VkSpecializationInfo info;
+
+public:
+  // T has to match the declared type: int32_t, uint32_t, float or VkBool32
+  template <typename T> SpecializationConstants &set(uint32_t id, T value) {
+    static_assert(sizeof(T) == 4, "specialization constants are 32 bit here");
+    entries.push_back({.constantID = id, .offset = static_cast<uint32_t>(data.size()), .size = sizeof(T)});
+    data.resize(data.size() + sizeof(T));
+    memcpy(data.data() + entries.back().offset, &value, sizeof(T));
+    return *this;
+  }
+
+  // for pSpecializationInfo, valid until the next set()
+  const VkSpecializationInfo *get() {
+    info = {.mapEntryCount = static_cast<uint32_t>(entries.size()),
+            .pMapEntries = entries.data(),
+            .dataSize = data.size(),
+            .pData = data.data()};
+    return &info;
+  }
+};
+
 const std::vector<const char *> validationLayers = {"VK_LAYER_KHRONOS_validation"};
 const std::vector<const char *> deviceExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
 
 struct QueueFamilyIndices {
   std::optional<uint32_t> graphicsFamily;
   std::optional<uint32_t> presentFamily;
+  std::optional<uint32_t> computeFamily;
+  // a transfer-only family when the device has one, the graphics family otherwise
+  std::optional<uint32_t> transferFamily;
 
-  bool isComplete() { return graphicsFamily.has_value() && presentFamily.has_value(); }
+  bool isComplete() {
+    return graphicsFamily.has_value() && presentFamily.has_value() && computeFamily.has_value();
+  }
 };
 
 struct SwapChainSupportDetails {
@@ -90,14 +473,47 @@ struct SwapChainSupportDetails {
 struct QueueFamilies {
   VkQueue presentQueue;
   VkQueue graphicsQueue;
+  VkQueue computeQueue;
+  VkQueue transferQueue;
+};
+
+// the indirect draws of one mesh, one per LOD level that has visible bodies, the unit the scene recording is
+// split on
+struct DrawBatch {
+  uint32_t mesh;
+  uint32_t firstBucket, bucketCount;
+  // picks the index buffer section the bucket's firstIndex counts from
+  VkIndexType indexType;
+};
+
+// a replaced swapchain and the views and framebuffers made for it, destroyed once every frame submitted
+// before the replacement has finished
+struct RetiredSwapChain {
+  VkSwapchainKHR swapChain;
+  std::vector<VkImageView> imageViews;
+  std::vector<VkFramebuffer> framebuffers;
+  // submittedFrames at the time, the frames before it may still use these
+  uint64_t retiredAt;
+};
+
+// the scene draws of one frame in flight, split into ranges recorded into secondary command buffers. they
+// are replayed until the scene or the swapchain changes, culling and LOD picks happen on the GPU
+struct SceneDrawCache {
+  // one per recording worker, the first rangeCount hold the current draws
+  std::vector<VkCommandBuffer> commandBuffers;
+  uint32_t rangeCount = 0;
+  uint64_t sceneVersion = UINT64_MAX, swapchainVersion = UINT64_MAX;
 };
 
 VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR> &availableFormats);
 VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR> &availablePresentModes);
 
 class VulkanEngine {
+  friend class RigidBodyManager;
+
 private:
   bool enableValidationLayers;
+  bool headless;
 
   const char *windowName;
   int width, height;
@@ -110,21 +526,85 @@ private:
   VkSurfaceKHR surface;
   VkQueue presentQueue;
 
+  // a dedicated compute family when the device has one, so simulation overlaps rasterization
+  VkQueue computeQueue;
+
+  // uploads run here, a dedicated family lets the copy engine work while the graphics queue draws
+  VkQueue transferQueue;
+
   VkSwapchainKHR swapChain;
   std::vector<VkImage> swapChainImages;
   VkFormat swapChainImageFormat;
   VkExtent2D swapChainExtent;
 
   std::vector<VkImageView> swapChainImageViews;
+  // oldest first, released from drawFrame as the frames in flight drain
+  std::deque<RetiredSwapChain> retiredSwapChains;
+  // frames handed to the graphics queue, the retired swapchains and buffers are released against it
+  uint64_t submittedFrames = 0;
   VkRenderPass renderPass;
   VkPipelineLayout pipelineLayout;
   VkPipeline graphicsPipeline;
 
+  // GPU N-body, step n reads particleBuffers[n - 1] and writes particleBuffers[n] (per frame slot),
+  // which the cull pass of frame n then reads directly
+  VkDescriptorSetLayout computeDescriptorSetLayout;
+  VkDescriptorPool descriptorPool;
+  std::vector<VkDescriptorSet> computeDescriptorSets;
+  VkPipelineLayout computePipelineLayout;
+  VkPipeline computePipeline;
+  std::vector<VkBuffer> particleBuffers;
+  std::vector<Allocation> particleMemory;
+  VkCommandPool computeCommandPool;
+  std::vector<VkCommandBuffer> computeCommandBuffers;
+  std::vector<VkSemaphore> computeFinishedSemaphores;
+
+  // culling and LOD selection on the graphics queue ahead of the scene pass, so the CPU records one
+  // vkCmdDrawIndexedIndirectCount per mesh whatever the body count. the tables follow the rigid body
+  // scene version, each frame slot rebuilds its buffers once its fence has signalled
+  std::vector<CullMesh> cullMeshes;
+  std::vector<CullBucket> cullBuckets;
+  uint32_t cullBodyCount = 0;
+  uint64_t cullTablesVersion = 0;
+  std::vector<CullFrame> cullFrames;
+  VkDescriptorSetLayout cullDescriptorSetLayout;
+  VkDescriptorPool cullDescriptorPool;
+  VkPipelineLayout cullPipelineLayout;
+  VkPipeline cullPipeline;
+
   std::vector<VkFramebuffer> swapChainFramebuffers;
 
+  // lensing draws the bodies into a scene image per frame slot (alpha 0 where empty), then a full-screen
+  // pass bends that image and a starfield through the deflection table into the swapchain image
+  VkRenderPass sceneRenderPass;
+  std::vector<VkImage> sceneImages;
+  std::vector<Allocation> sceneImageMemory;
+  std::vector<VkImageView> sceneImageViews;
+  std::vector<VkFramebuffer> sceneFramebuffers;
+  // swapchainVersion each slot's target was sized for
+  std::vector<uint64_t> lensingTargetVersions;
+  DeflectionTable deflectionTable;
+  VkImage deflectionImage;
+  Allocation deflectionImageMemory;
+  VkImageView deflectionImageView;
+  VkSampler lensingSampler;
+  VkDescriptorSetLayout lensingDescriptorSetLayout;
+  VkDescriptorPool lensingDescriptorPool;
+  std::vector<VkDescriptorSet> lensingDescriptorSets;
+  VkPipelineLayout lensingPipelineLayout;
+  VkPipeline lensingPipeline;
+
   VkCommandPool commandPool;
 
   std::vector<VkCommandBuffer> commandBuffers;
+
+  // recording pool of worker w for frame slot f at w * max_inflight_frames + f, each holds one secondary
+  std::vector<VkCommandPool> recordingPools;
+  std::vector<SceneDrawCache> sceneDrawCaches;
+  std::vector<DrawBatch> drawList;
+  uint64_t swapchainVersion = 0;
+  // fewer draws than this per range cost more in thread startup than they save
+  static constexpr size_t minDrawsPerRange = 256;
   std::vector<VkSemaphore> imageAvailableSemaphores;
   std::vector<VkSemaphore> renderFinishedSemaphores;
   std::vector<VkFence> inFlightFences;
@@ -133,9 +613,42 @@ private:
 
   int max_inflight_frames;
 
-  // transfer command buffer bulk queueing
+  // view scale and the largest on-screen error, in pixels, a circle LOD may have
+  float zoom = 1.0f;
+  float lodMaxError = 0.25f;
+
+  // particle i drives instance i of the "circle" geometry
+  ParticleStore particles;
+  BarnesHutSolver solver;
+  // the geometry whose instances the simulation moves, particle i is instance i
+  SlotHandle circleGeometry;
+
+  // the CPU simulation steps on its own thread, which owns particles and solver while it runs, and hands
+  // positions to the render loop through here
+  TripleBuffer<SimulationSnapshot> simulationSnapshots;
+  std::thread simulationThread;
+  std::atomic<bool> simulationRunning{false};
+
+  // headless mode renders into our own images and copies every frame into a ring of
+  // host-visible buffers, one per frame in flight
+  std::vector<Allocation> offscreenImageMemory;
+  std::vector<VkBuffer> readbackBuffers;
+  std::vector<Allocation> readbackMemory;
+  std::vector<std::optional<uint64_t>> pendingReadbacks;
+  uint64_t frameNumber = 0;
+
+  // what the perf report is built from
+  double startupSeconds = 0.0;
+  std::vector<double> frameSeconds, stepSeconds;
+
+  // every buffer and image is sub-allocated from here
+  DeviceAllocator allocator;
+
   RigidBodyManager rigidBodyManager;
-  VkCommandBuffer transferCommandBuffer;
+  // every upload goes through here, on the graphics queue
+  StagingRing staging;
+  PipelineCache pipelineCache;
+  Profiler profiler;
 
   // physical device management
   QueueFamilyIndices findSuitableQueueFamiles(VkPhysicalDevice device);
@@ -143,6 +656,9 @@ private:
   std::tuple<VkDevice, VkPhysicalDevice, QueueFamilies>
   pickPhysicalDevice(std::optional<std::vector<const char *>> validationLayers);
   bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+  // timeline semaphores and indirect count draws
+  bool checkFeatureSupport(VkPhysicalDevice device);
+  std::vector<const char *> getRequiredDeviceExtensions();
   SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice *device);
   std::vector<std::tuple<VkPhysicalDevice, VkPhysicalDeviceProperties, VkPhysicalDeviceFeatures>>
   getAvailableDevices();
@@ -173,14 +689,49 @@ private:
 
   void createInstance();
   void setupDebugMessenger();
-  void createSwapChain();
+  // oldSwapChain is retired by the new one but keeps presenting what was already queued
+  void createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE);
+  // moves the swapchain and its views and framebuffers to retiredSwapChains and returns it
+  VkSwapchainKHR retireSwapChain();
+  // destroys the retired swapchains no frame in flight uses any more, or all of them once the device is idle
+  void releaseRetiredSwapChains(bool all);
+  void createOffscreenTarget();
+  void createReadbackBuffers();
   void createImageViews();
   void createRenderPass();
   void createGraphicsPipeline();
+  void createDescriptorSetLayouts();
+  void createComputePipeline();
+  void createParticleBuffers();
+  void createDescriptorSets();
   void createFramebuffers();
   void createCommandPool();
 
+  void createLensingResources();
+  void createDeflectionImage();
+  void createLensingPipeline();
+  void createLensingTargets();
+  void createLensingTarget(uint32_t slot);
+  void destroyLensingTarget(uint32_t slot);
+  // resizes the slot's target after a swapchain change, only once the slot's fence has signalled
+  void refreshLensingTarget(uint32_t slot);
+
+  void createCullResources();
+  void buildCullTables();
+  void createCullFrame(uint32_t slot);
+  void destroyCullFrame(uint32_t slot);
+  // rebuilds the slot's tables and buffers after a scene change, only once the slot's fence has signalled
+  void refreshCullFrame(uint32_t slot);
+  void createCullPipeline();
+
   void createGeometries();
+  void createOrbitScene(RigidBody &circle);
+  void stepSimulation();
+  void startSimulationThread();
+  void stopSimulationThread();
+  void simulationLoop();
+  // moves the circle instances to where the simulation is at this moment
+  void interpolateSimulation();
 
   void createCommandBuffers();
   void createSyncObjects();
@@ -188,50 +739,105 @@ private:
   void initVulkan();
 
   void drawFrame();
-  void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+  void drawFrameHeadless();
+  // returns the staging timeline value the frame's submit has to wait for, 0 when it acquired nothing
+  uint64_t recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+  // re-records the frame's scene draws in parallel ranges if they are stale and returns them
+  const SceneDrawCache &updateSceneDraws(uint32_t frame);
+  void recordDrawRange(VkCommandBuffer commandBuffer, uint32_t frame, size_t begin, size_t end);
+  void recordCulling(VkCommandBuffer commandBuffer, uint32_t frame);
+  void recordComputeCommandBuffer(VkCommandBuffer commandBuffer, uint32_t frame);
+  VkSemaphore submitComputeStep(uint32_t frame);
+  void recordLensingPass(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+  void recordReadback(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+  void consumeReadback(uint32_t slot);
+  void headlessLoop();
+  void writePerfReport(const std::string &path);
 
   void mainLoop() {
+    if (headless) {
+      headlessLoop();
+      return;
+    }
+
+    // the simulation keeps its own pace, vsync and slow frames only change how often we sample it
+    if (simulation == SimulationBackend::Cpu)
+      startSimulationThread();
+
     while (!glfwWindowShouldClose(window)) {
       glfwPollEvents();
+      if (simulation == SimulationBackend::Cpu)
+        interpolateSimulation();
       drawFrame();
     }
 
+    stopSimulationThread();
     vkDeviceWaitIdle(device);
   }
 
   void cleanup();
   void cleanupSwapChain();
+  void cleanupOffscreenTarget();
+  void cleanupCompute();
+  void cleanupCulling();
+  void cleanupLensingTargets();
+  void cleanupLensing();
 
 public:
   bool frameBufferResized = false;
   VkDevice device;
   VkPhysicalDevice physicalDevice;
 
+  // static scene configuration, bodies sit in a square grid
+  uint32_t gridBodyCount = 100;
+  // how the meshes are stored in the vertex buffer
+  VertexLayout vertexLayout = VertexLayout::Snorm16;
+
+  // N-body scene configuration, bodies orbit a central mass instead of sitting in a grid
+  SimulationBackend simulation = SimulationBackend::None;
+  uint32_t simulatedBodyCount = 10000;
+  float simulationDt = 2e-3f;
+  // CPU simulation steps per wall clock second in the windowed loop, each advancing simulationDt
+  float simulationRate = 60.0f;
+
+  // gravitational lensing around the central mass, the camera looks straight at the hole
+  bool lensing = false;
+  LensCamera lensCamera;
+
+  // headless run configuration
+  uint32_t headlessFrameCount = 1000;
+  std::string headlessOutputPath;
+  // frame time percentiles, upload bytes, device memory, startup and step times go here as JSON
+  std::string perfReportPath;
+  std::function<void(const uint8_t *pixels, VkExtent2D extent, uint64_t frame)> onFrameReadback;
+
+  // compiled pipelines are kept here between launches
+  std::string pipelineCachePath = "pipeline_cache.bin";
+
+  // CPU and GPU timings go to this Chrome trace at shutdown, profiling is off when empty
+  std::string profilePath;
+
   VulkanEngine(int width, int height, int max_inflight_frames, bool enableValidationLayers,
-               const char *windowName)
+               const char *windowName, bool headless = false)
       : width(width), height(height), max_inflight_frames(max_inflight_frames),
-        enableValidationLayers(enableValidationLayers), windowName(windowName),
+        enableValidationLayers(enableValidationLayers), headless(headless), windowName(windowName),
         rigidBodyManager(RigidBodyManager(this)) {}
-  VkShaderModule createShaderModule(const std::vector<char> &code);
+  // code is one of the embedded arrays in spirv.h
+  VkShaderModule createShaderModule(const uint32_t *code, size_t codeSize);
   bool checkValidationLayerSupport();
   std::vector<const char *> getRequiredExtensions();
 
-  void initializeTransferBuffer();
-  void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-  void endTransfers();
-  void waitForTransfers();
-  void beginTransfers();
-
   ~VulkanEngine() { this->cleanup(); }
 
+  // no device wait, the frames in flight finish on the old images while the next ones use the new. the
+  // lensing targets follow slot by slot in recordCommandBuffer
   void recreateSwapChain() {
-    vkDeviceWaitIdle(device);
-
-    cleanupSwapChain();
+    ProfileScope scope(profiler, "recreateSwapChain");
 
-    createSwapChain();
+    createSwapChain(retireSwapChain());
     createImageViews();
     createFramebuffers();
+    swapchainVersion++;
   }
 
   static void framebufferResizeCallback(GLFWwindow *window, int width, int height) {
@@ -239,26 +845,81 @@ public:
     app->frameBufferResized = true;
   }
 
+  static void scrollCallback(GLFWwindow *window, double xoffset, double yoffset) {
+    auto app = reinterpret_cast<VulkanEngine *>(glfwGetWindowUserPointer(window));
+    app->zoom *= std::pow(1.1f, static_cast<float>(yoffset));
+  }
+
+  // cleanup happens in the destructor
   void run() {
-    initWindow();
+    auto start = std::chrono::steady_clock::now();
+    if (!headless)
+      initWindow();
     initVulkan();
+    startupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     mainLoop();
-    cleanup();
   }
 };
 
-std::vector<char> readFile(const std::string &filename);
+void savePPM(const std::string &filename, const uint8_t *pixels, VkExtent2D extent, bool bgra);
+
+// bodyCount bodies filling a square grid row by row, 100 is the original 10x10 grid
+void buildGridScene(uint32_t bodyCount, std::vector<Instance> &instances);
+
+// particle i of the orbiting disc is drawn by instance i, shared by the engine and the CPU tracer
+void buildOrbitScene(uint32_t bodyCount, float G, ParticleStore &particles, std::vector<Instance> &instances);
+
 VkShaderModule createShaderModule(const std::vector<char> &code, VkDevice *device);
 
-struct RigidBody {
+// one tessellation of a mesh stored inside its owner's vertex/index arrays
+struct LodLevel {
+  uint32_t segments;
+  uint32_t firstIndex, indexCount;
+  int32_t vertexOffset;
+};
+
+// vertex and index data shared by every geometry with the same content
+struct Mesh {
   std::vector<Vertex> vertices;
   std::vector<uint32_t> indices;
+  // coarsest to finest, empty when the mesh has a single tessellation
+  std::vector<LodLevel> lods;
+  uint64_t hash;
+  // 16-bit whenever every index fits
+  VkIndexType indexType;
 
   VkDeviceSize indexOffset, vertexOffset;
 
-  VkDeviceSize getVertSize() { return sizeof(Vertex) * vertices.size(); }
-  VkDeviceSize getIndexSize() { return sizeof(uint32_t) * indices.size(); }
+  VkDeviceSize getVertSize(VertexLayout layout) const { return Vertex::stride(layout) * vertices.size(); }
+  VkDeviceSize getIndexSize() const {
+    return (indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t)) * indices.size();
+  }
+};
+
+// built with its own vertices, indices and lods, which addGeometry moves into the manager's shared meshes
+struct RigidBody {
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+  std::vector<Instance> instances;
+
+  // coarsest to finest, empty when the mesh has a single tessellation
+  std::vector<LodLevel> lods;
+  // a color every vertex shares, addGeometry moves it here so the mesh only holds the shape. cull.comp
+  // multiplies it into the instance colors
+  glm::vec3 color{1.0f, 1.0f, 1.0f};
+
+  // index into RigidBodyManager::meshes once added
+  uint32_t mesh = UINT32_MAX;
+  // the mesh's offsets and index type, copied here by calculateOffsets
+  VkDeviceSize indexOffset, vertexOffset, instanceOffset;
+  VkIndexType indexType;
+
+  VkDeviceSize getInstanceSize() const { return sizeof(Instance) * instances.size(); }
+
 
-  static RigidBody createSphere(float x, float y, float r, glm::vec3 color);
+  static RigidBody createSphere(float x, float y, float r, glm::vec3 color, uint32_t increments = 10000);
+  static RigidBody createCircleLods(glm::vec3 color, uint32_t minSegments = 8, uint32_t maxSegments = 4096);
   static RigidBody createSquare(float x, float y, float half_length, glm::vec3 color);
+  // cull.comp picks LOD levels by the same rule
+  static uint32_t segmentsForError(float radiusPixels, float maxErrorPixels);
 };
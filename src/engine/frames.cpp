@@ -1,13 +1,26 @@
 #include "engine.h"
+#include "parallel.h"
+#include <algorithm>
 
 using namespace std;
 
 void VulkanEngine::drawFrame() {
-  vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+  ProfileScope frameScope(profiler, "drawFrame");
+
+  {
+    ProfileScope scope(profiler, "fence wait");
+    vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+  }
+  profiler.collect(currentFrame);
+  releaseRetiredSwapChains(false);
 
   uint32_t imageIndex;
-  VkResult result = vkAcquireNextImageKHR(
-      device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+  VkResult result;
+  {
+    ProfileScope scope(profiler, "acquire");
+    result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame],
+                                   VK_NULL_HANDLE, &imageIndex);
+  }
 
   if (result == VK_ERROR_OUT_OF_DATE_KHR) {
     recreateSwapChain();
@@ -18,25 +31,60 @@ void VulkanEngine::drawFrame() {
 
   vkResetFences(device, 1, &inFlightFences[currentFrame]);
 
-  vkResetCommandBuffer(commandBuffers[currentFrame], 0);
-  recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+  rigidBodyManager.syncInstances(currentFrame);
+
+  uint64_t uploads;
+  {
+    ProfileScope scope(profiler, "record");
+    vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+    uploads = recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+  }
 
-  VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-  VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
   VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-  VkSubmitInfo submitInfo{
-      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .waitSemaphoreCount = 1,
-      .pWaitSemaphores = waitSemaphores,
-      .pWaitDstStageMask = waitStages,
-      .commandBufferCount = 1,
-      .pCommandBuffers = &commandBuffers[currentFrame],
-      .signalSemaphoreCount = 1,
-      .pSignalSemaphores = signalSemaphores,
-  };
+  {
+    ProfileScope scope(profiler, "submit");
+    vector<VkSemaphore> waitSemaphores = {imageAvailableSemaphores[currentFrame]};
+    vector<VkPipelineStageFlags> waitStages = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+    // binary semaphores ignore their value
+    vector<uint64_t> waitValues = {0};
+
+    // only the cull pass reads the particles, acquiring the image and the uploads can start before the step
+    if (simulation == SimulationBackend::Gpu) {
+      waitSemaphores.push_back(submitComputeStep(currentFrame));
+      waitStages.push_back(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+      waitValues.push_back(0);
+    }
+
+    // only the batch holding the newest release this frame acquires, later uploads do not hold it up
+    if (uploads > 0) {
+      waitSemaphores.push_back(staging.getTimeline());
+      waitStages.push_back(StagingRing::consumerStages);
+      waitValues.push_back(uploads);
+    }
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo{
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size()),
+        .pWaitSemaphoreValues = waitValues.data(),
+    };
+
+    VkSubmitInfo submitInfo{
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &timelineInfo,
+        .waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size()),
+        .pWaitSemaphores = waitSemaphores.data(),
+        .pWaitDstStageMask = waitStages.data(),
+        .commandBufferCount = 1,
+        .pCommandBuffers = &commandBuffers[currentFrame],
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = signalSemaphores,
+    };
 
-  if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
-    throw runtime_error("failed to submit draw command buffer!");
+    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
+      throw runtime_error("failed to submit draw command buffer!");
+    }
+    profiler.markSubmitted(currentFrame);
+    submittedFrames++;
   }
 
   VkSwapchainKHR swapChains[] = {swapChain};
@@ -50,7 +98,10 @@ void VulkanEngine::drawFrame() {
       .pResults = nullptr,
   };
 
-  result = vkQueuePresentKHR(presentQueue, &presentInfo);
+  {
+    ProfileScope scope(profiler, "present");
+    result = vkQueuePresentKHR(presentQueue, &presentInfo);
+  }
 
   if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || frameBufferResized) {
     frameBufferResized = false;
@@ -62,7 +113,14 @@ void VulkanEngine::drawFrame() {
   currentFrame = (currentFrame + 1) % max_inflight_frames;
 }
 
-void VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+uint64_t VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+  // this slot's fence has signalled, so its secondaries, cull buffers and lensing target are free to be
+  // rebuilt
+  refreshCullFrame(currentFrame);
+  if (lensing)
+    refreshLensingTarget(currentFrame);
+  const SceneDrawCache &sceneDraws = updateSceneDraws(currentFrame);
+
   VkCommandBufferBeginInfo beginInfo{
       .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
       .flags = 0,
@@ -74,19 +132,93 @@ void VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t i
     throw runtime_error("failed to begin recording command buffer!");
   }
 
+  profiler.beginGpuFrame(commandBuffer, currentFrame);
+
+  // take ownership of whatever the transfer queue uploaded since the last frame
+  uint64_t uploads = staging.acquire(commandBuffer);
+
+  // picks the visible bodies and their LOD levels and writes the indirect draws the secondaries replay
+  {
+    GpuProfileScope scope(profiler, commandBuffer, currentFrame, "culling");
+    recordCulling(commandBuffer, currentFrame);
+  }
+
+  // with lensing the bodies go to this frame's scene image first, alpha 0 marks where the starfield shows
   VkRenderPassBeginInfo renderPassInfo{
       .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-      .renderPass = renderPass,
-      .framebuffer = swapChainFramebuffers[imageIndex],
+      .renderPass = lensing ? sceneRenderPass : renderPass,
+      .framebuffer = lensing ? sceneFramebuffers[currentFrame] : swapChainFramebuffers[imageIndex],
       .renderArea = {.offset = {0, 0}, .extent = swapChainExtent},
   };
 
-  VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
+  VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, lensing ? 0.0f : 1.0f}}};
   renderPassInfo.clearValueCount = 1;
   renderPassInfo.pClearValues = &clearColor;
 
-  vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+  {
+    GpuProfileScope scope(profiler, commandBuffer, currentFrame, "scene");
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    vkCmdExecuteCommands(commandBuffer, sceneDraws.rangeCount, sceneDraws.commandBuffers.data());
+    vkCmdEndRenderPass(commandBuffer);
+  }
+
+  if (lensing) {
+    GpuProfileScope scope(profiler, commandBuffer, currentFrame, "lensing");
+    recordLensingPass(commandBuffer, imageIndex);
+  }
+
+  if (headless) {
+    GpuProfileScope scope(profiler, commandBuffer, currentFrame, "readback");
+    recordReadback(commandBuffer, imageIndex);
+  }
 
+  if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+    throw runtime_error("failed to record command buffer!");
+  }
+  return uploads;
+}
+
+const SceneDrawCache &VulkanEngine::updateSceneDraws(uint32_t frame) {
+  SceneDrawCache &cache = sceneDrawCaches[frame];
+  if (cache.sceneVersion == rigidBodyManager.sceneVersion && cache.swapchainVersion == swapchainVersion)
+    return cache;
+
+  // one range per worker at most, so every range has a pool of its own. small lists stay on this thread
+  size_t workers = cache.commandBuffers.size();
+  size_t chunk = max(minDrawsPerRange, (drawList.size() + workers - 1) / workers);
+  cache.rangeCount = static_cast<uint32_t>(max<size_t>(1, (drawList.size() + chunk - 1) / chunk));
+
+  parallelFor(max<size_t>(drawList.size(), 1), chunk, [&](size_t begin, size_t end) {
+    size_t range = begin / chunk;
+    vkResetCommandPool(device, recordingPools[range * max_inflight_frames + frame], 0);
+    recordDrawRange(cache.commandBuffers[range], frame, begin, min(end, drawList.size()));
+  });
+
+  cache.sceneVersion = rigidBodyManager.sceneVersion;
+  cache.swapchainVersion = swapchainVersion;
+  return cache;
+}
+
+// runs on a worker thread, everything it touches besides its own command buffer is only read
+void VulkanEngine::recordDrawRange(VkCommandBuffer commandBuffer, uint32_t frame, size_t begin, size_t end) {
+  // no framebuffer in the inheritance, so one recording serves every swapchain image
+  VkCommandBufferInheritanceInfo inheritanceInfo{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+      .renderPass = lensing ? sceneRenderPass : renderPass,
+      .subpass = 0,
+      .framebuffer = VK_NULL_HANDLE,
+  };
+  VkCommandBufferBeginInfo beginInfo{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+      .pInheritanceInfo = &inheritanceInfo,
+  };
+
+  if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+    throw runtime_error("failed to begin recording scene draws!");
+  }
+
+  // secondaries inherit no state, every range binds its own
   vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
 
   VkViewport viewport{};
@@ -103,15 +235,29 @@ void VulkanEngine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t i
   scissor.extent = swapChainExtent;
   vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-  for (auto const &[k, v] : this->rigidBodyManager.geometries) {
-    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &rigidBodyManager.vertexBuffer, &v.vertexOffset);
-    vkCmdBindIndexBuffer(commandBuffer, rigidBodyManager.indexBuffer, v.indexOffset, VK_INDEX_TYPE_UINT32);
-    vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(v.indices.size()), 1, 0, 0, 0);
-  }
+  // the visible instances of every mesh sit in one buffer, firstInstance of each draw points into it
+  const CullFrame &culled = cullFrames[frame];
+  VkBuffer vertexBuffers[] = {rigidBodyManager.vertexBuffer, culled.visible};
+  VkDeviceSize offsets[] = {0, 0};
+  vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
 
-  vkCmdEndRenderPass(commandBuffer);
+  // one draw per LOD level with visible bodies, the cull pass writes both the commands and their count.
+  // the index buffer is rebound only where the index width changes
+  VkIndexType boundType = VK_INDEX_TYPE_MAX_ENUM;
+  for (size_t i = begin; i < end; i++) {
+    const DrawBatch &batch = drawList[i];
+    if (batch.indexType != boundType) {
+      VkDeviceSize offset = batch.indexType == VK_INDEX_TYPE_UINT16 ? 0 : rigidBodyManager.index32Offset;
+      vkCmdBindIndexBuffer(commandBuffer, rigidBodyManager.indexBuffer, offset, batch.indexType);
+      boundType = batch.indexType;
+    }
+    vkCmdDrawIndexedIndirectCount(commandBuffer, culled.commands,
+                                  batch.firstBucket * sizeof(VkDrawIndexedIndirectCommand), culled.counters,
+                                  batch.mesh * sizeof(uint32_t), batch.bucketCount,
+                                  sizeof(VkDrawIndexedIndirectCommand));
+  }
 
   if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-    throw runtime_error("failed to record command buffer!");
+    throw runtime_error("failed to record scene draws!");
   }
 }
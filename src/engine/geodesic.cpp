@@ -0,0 +1,84 @@
+#include "geodesic.h"
+#include "parallel.h"
+#include <cmath>
+
+using namespace std;
+
+RayDeflection traceRay(float impactParameter, float observerDistance, const IntegratorSettings &settings) {
+  double b = impactParameter;
+  RayDeflection ray;
+  traceRays(&b, 1, observerDistance, &ray, settings);
+  return ray;
+}
+
+uint64_t traceRays(const double *impactParameters, size_t count, double observerDistance, RayDeflection *rays,
+                   const IntegratorSettings &settings) {
+  const double pi = 3.14159265358979323846;
+  const double r = observerDistance, u0 = 1.0 / r;
+
+  // rays fired inward from the observer, lanes[k] is the ray batch lane k traces
+  GeodesicBatch batch;
+  vector<size_t> lanes;
+  for (size_t i = 0; i < count; i++) {
+    double b = impactParameters[i];
+
+    // (du/dphi)^2 = 1/b^2 - u^2 (1 - 2u), a negative value means no inward ray has this impact parameter
+    double slope2 = 1.0 / (b * b) - u0 * u0 * (1.0 - 2.0 * u0);
+    if (b <= 0.0 || !(slope2 >= 0.0)) {
+      rays[i] = {.deflection = 0.0f, .captured = b <= 0.0};
+      continue;
+    }
+
+    batch.u.push_back(u0);
+    batch.w.push_back(sqrt(slope2));
+    lanes.push_back(i);
+  }
+
+  uint64_t steps = integrateGeodesics(batch, settings);
+
+  for (size_t k = 0; k < lanes.size(); k++) {
+    size_t i = lanes[k];
+    if (batch.fate[k] != GeodesicFate::Escaped) {
+      rays[i] = {.deflection = 0.0f, .captured = true};
+      continue;
+    }
+
+    double launchAngle = asin(min(1.0, impactParameters[i] * sqrt(1.0 - 2.0 / r) / r));
+    rays[i] = {.deflection = static_cast<float>(batch.sweep[k] - (pi - launchAngle)), .captured = false};
+  }
+
+  return steps;
+}
+
+DeflectionTable DeflectionTable::build(uint32_t impactSamples, uint32_t distanceSamples, float maxImpact,
+                                       float minDistance, float maxDistance) {
+  DeflectionTable table{.impactSamples = impactSamples,
+                        .distanceSamples = distanceSamples,
+                        .maxImpact = maxImpact,
+                        .minLogDistance = logf(minDistance),
+                        .maxLogDistance = logf(maxDistance)};
+  table.texels.resize(2 * static_cast<size_t>(impactSamples) * distanceSamples);
+
+  parallelFor(distanceSamples, 1, [&](size_t begin, size_t end) {
+    vector<double> impacts(impactSamples);
+    vector<RayDeflection> rays(impactSamples);
+    for (uint32_t col = 0; col < impactSamples; col++) {
+      impacts[col] = impactSamples > 1 ? static_cast<float>(maxImpact * col / (impactSamples - 1)) : 0.0f;
+    }
+
+    // one batch per row, every ray of a row starts at the same distance
+    for (size_t row = begin; row < end; row++) {
+      float t = distanceSamples > 1 ? static_cast<float>(row) / (distanceSamples - 1) : 0.0f;
+      float distance = expf(table.minLogDistance + t * (table.maxLogDistance - table.minLogDistance));
+      traceRays(impacts.data(), impactSamples, distance, rays.data());
+
+      for (uint32_t col = 0; col < impactSamples; col++) {
+        size_t texel = 2 * (row * impactSamples + col);
+        table.texels[texel + 0] = rays[col].deflection;
+        table.texels[texel + 1] = rays[col].captured ? 1.0f : 0.0f;
+      }
+    }
+  });
+
+  return table;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "integrator.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Schwarzschild light bending, lengths in units of the black hole mass (G = c = M = 1)
+
+// rays launched inward with a smaller impact parameter cross the photon sphere and fall in
+const float criticalImpactParameter = 5.196152422706632f; // 3 sqrt(3)
+
+// static observer looking straight at the hole, shared by the lensing pass and the CPU tracer
+struct LensCamera {
+  float observerDistance = 50.0f;
+  // vertical, in radians
+  float fieldOfView = 0.7f;
+};
+
+struct RayDeflection {
+  // extra bend relative to a straight ray, positive toward the hole
+  float deflection;
+  bool captured;
+};
+
+// traces a ray back from a static observer at observerDistance, fired inward with impact parameter b
+RayDeflection traceRay(float impactParameter, float observerDistance,
+                       const IntegratorSettings &settings = {});
+
+// traceRay for many rays sharing one observer, integrated as a single batch. returns the steps taken
+uint64_t traceRays(const double *impactParameters, size_t count, double observerDistance, RayDeflection *rays,
+                   const IntegratorSettings &settings = {});
+
+// deflection over impact parameter (columns, linear in [0, maxImpact]) and observer distance (rows, linear
+// in log distance), stored as interleaved (deflection, captured) pairs ready for an RG texture
+struct DeflectionTable {
+  uint32_t impactSamples = 0, distanceSamples = 0;
+  float maxImpact = 0.0f;
+  float minLogDistance = 0.0f, maxLogDistance = 0.0f;
+  std::vector<float> texels;
+
+  static DeflectionTable build(uint32_t impactSamples, uint32_t distanceSamples, float maxImpact,
+                               float minDistance, float maxDistance);
+};
@@ -0,0 +1,211 @@
+#include "gravity.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GRAVITY_X86 1
+#endif
+
+using namespace std;
+
+// 3 floats per source, 12 KiB per block keeps the sources in L1 while every target streams past them
+static const size_t sourceBlock = 1024;
+
+static void directScalar(const float *tx, const float *ty, size_t targetCount, const float *sx,
+                         const float *sy, const float *sm, size_t sourceCount, float eps2, float *ax,
+                         float *ay) {
+  for (size_t jb = 0; jb < sourceCount; jb += sourceBlock) {
+    size_t je = min(sourceCount, jb + sourceBlock);
+    for (size_t i = 0; i < targetCount; i++) {
+      float accX = 0.0f, accY = 0.0f;
+      for (size_t j = jb; j < je; j++) {
+        float dx = sx[j] - tx[i], dy = sy[j] - ty[i];
+        float r2 = dx * dx + dy * dy + eps2;
+        if (r2 == 0.0f)
+          continue;
+        float inv = 1.0f / sqrtf(r2);
+        float s = sm[j] * inv * inv * inv;
+        accX += s * dx;
+        accY += s * dy;
+      }
+      ax[i] += accX;
+      ay[i] += accY;
+    }
+  }
+}
+
+#ifdef GRAVITY_X86
+
+// targets across the lanes, one broadcast source per iteration, so the accumulators never leave registers
+__attribute__((target("avx2,fma"))) static void directAvx2(const float *tx, const float *ty,
+                                                            size_t targetCount, const float *sx,
+                                                            const float *sy, const float *sm,
+                                                            size_t sourceCount, float eps2, float *ax,
+                                                            float *ay) {
+  const __m256 vEps2 = _mm256_set1_ps(eps2);
+  const __m256 half = _mm256_set1_ps(0.5f), threeHalves = _mm256_set1_ps(1.5f);
+  const __m256 zero = _mm256_setzero_ps();
+
+  for (size_t jb = 0; jb < sourceCount; jb += sourceBlock) {
+    size_t je = min(sourceCount, jb + sourceBlock);
+    for (size_t i = 0; i < targetCount; i += 8) {
+      // lanes past the end load zero and are never stored
+      int remaining = static_cast<int>(min<size_t>(targetCount - i, 8));
+      __m256i lanes =
+          _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+      __m256 x = _mm256_maskload_ps(tx + i, lanes), y = _mm256_maskload_ps(ty + i, lanes);
+      __m256 accX = zero, accY = zero;
+
+      for (size_t j = jb; j < je; j++) {
+        __m256 dx = _mm256_sub_ps(_mm256_broadcast_ss(sx + j), x);
+        __m256 dy = _mm256_sub_ps(_mm256_broadcast_ss(sy + j), y);
+        __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, vEps2));
+
+        // 12-bit estimate plus one Newton step, y' = y (3/2 - r2/2 y^2)
+        __m256 inv = _mm256_rsqrt_ps(r2);
+        __m256 halfR2 = _mm256_mul_ps(half, r2);
+        inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(halfR2, _mm256_mul_ps(inv, inv), threeHalves));
+        inv = _mm256_and_ps(inv, _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+
+        __m256 inv3 = _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv));
+        __m256 s = _mm256_mul_ps(_mm256_broadcast_ss(sm + j), inv3);
+        accX = _mm256_fmadd_ps(s, dx, accX);
+        accY = _mm256_fmadd_ps(s, dy, accY);
+      }
+
+      _mm256_maskstore_ps(ax + i, lanes, _mm256_add_ps(_mm256_maskload_ps(ax + i, lanes), accX));
+      _mm256_maskstore_ps(ay + i, lanes, _mm256_add_ps(_mm256_maskload_ps(ay + i, lanes), accY));
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) static void directAvx512(const float *tx, const float *ty,
+                                                             size_t targetCount, const float *sx,
+                                                             const float *sy, const float *sm,
+                                                             size_t sourceCount, float eps2, float *ax,
+                                                             float *ay) {
+  const __m512 vEps2 = _mm512_set1_ps(eps2);
+  const __m512 half = _mm512_set1_ps(0.5f), threeHalves = _mm512_set1_ps(1.5f);
+  const __m512 zero = _mm512_setzero_ps();
+
+  for (size_t jb = 0; jb < sourceCount; jb += sourceBlock) {
+    size_t je = min(sourceCount, jb + sourceBlock);
+    for (size_t i = 0; i < targetCount; i += 16) {
+      size_t remaining = targetCount - i;
+      __mmask16 lanes = static_cast<__mmask16>(remaining >= 16 ? 0xffff : (1u << remaining) - 1);
+      __m512 x = _mm512_maskz_loadu_ps(lanes, tx + i), y = _mm512_maskz_loadu_ps(lanes, ty + i);
+      __m512 accX = zero, accY = zero;
+
+      for (size_t j = jb; j < je; j++) {
+        __m512 dx = _mm512_sub_ps(_mm512_set1_ps(sx[j]), x);
+        __m512 dy = _mm512_sub_ps(_mm512_set1_ps(sy[j]), y);
+        __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, vEps2));
+
+        // 14-bit estimate, one Newton step gets close to full float precision
+        __m512 inv = _mm512_rsqrt14_ps(r2);
+        __m512 halfR2 = _mm512_mul_ps(half, r2);
+        inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(halfR2, _mm512_mul_ps(inv, inv), threeHalves));
+        inv = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ), inv);
+
+        __m512 inv3 = _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv));
+        __m512 s = _mm512_mul_ps(_mm512_set1_ps(sm[j]), inv3);
+        accX = _mm512_fmadd_ps(s, dx, accX);
+        accY = _mm512_fmadd_ps(s, dy, accY);
+      }
+
+      _mm512_mask_storeu_ps(ax + i, lanes, _mm512_add_ps(_mm512_maskz_loadu_ps(lanes, ax + i), accX));
+      _mm512_mask_storeu_ps(ay + i, lanes, _mm512_add_ps(_mm512_maskz_loadu_ps(lanes, ay + i), accY));
+    }
+  }
+}
+
+#endif
+
+vector<GravityKernelInfo> supportedGravityKernels() {
+  vector<GravityKernelInfo> kernels;
+#ifdef GRAVITY_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    kernels.push_back({"avx512", directAvx512});
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    kernels.push_back({"avx2", directAvx2});
+#endif
+  kernels.push_back({"scalar", directScalar});
+  return kernels;
+}
+
+void directAccelerations(const float *tx, const float *ty, size_t targetCount, const float *sx,
+                         const float *sy, const float *sm, size_t sourceCount, float eps2, float *ax,
+                         float *ay) {
+  static const GravityKernel kernel = supportedGravityKernels().front().kernel;
+  kernel(tx, ty, targetCount, sx, sy, sm, sourceCount, eps2, ax, ay);
+}
+
+void directAccelerationsReference(const float *tx, const float *ty, size_t targetCount, const float *sx,
+                                  const float *sy, const float *sm, size_t sourceCount, double eps2,
+                                  double *ax, double *ay) {
+  for (size_t i = 0; i < targetCount; i++) {
+    for (size_t j = 0; j < sourceCount; j++) {
+      double dx = static_cast<double>(sx[j]) - tx[i], dy = static_cast<double>(sy[j]) - ty[i];
+      double r2 = dx * dx + dy * dy + eps2;
+      if (r2 == 0.0)
+        continue;
+      double inv = 1.0 / sqrt(r2);
+      double s = sm[j] * inv * inv * inv;
+      ax[i] += s * dx;
+      ay[i] += s * dy;
+    }
+  }
+}
+
+bool checkGravityKernels() {
+  // sizes straddle the vector widths and the source block
+  const size_t sizes[] = {1, 7, 17, 100, 1023, 1025, 3001};
+  const float softenings[] = {0.0f, 1e-3f};
+  // float sums of a few thousand terms, relative to the largest acceleration in the cloud
+  const double tolerance = 1e-5;
+
+  mt19937 rng(1);
+  uniform_real_distribution<float> position(-1.0f, 1.0f), mass(0.0f, 1.0f);
+
+  bool passed = true;
+  for (auto const &info : supportedGravityKernels()) {
+    double worst = 0.0;
+
+    for (size_t n : sizes) {
+      for (float softening : softenings) {
+        vector<float> x(n), y(n), m(n);
+        for (size_t i = 0; i < n; i++) {
+          x[i] = position(rng);
+          y[i] = position(rng);
+          m[i] = mass(rng);
+        }
+
+        float eps2 = softening * softening;
+        vector<float> ax(n, 0.0f), ay(n, 0.0f);
+        vector<double> refX(n, 0.0), refY(n, 0.0);
+        info.kernel(x.data(), y.data(), n, x.data(), y.data(), m.data(), n, eps2, ax.data(), ay.data());
+        directAccelerationsReference(x.data(), y.data(), n, x.data(), y.data(), m.data(), n, eps2,
+                                     refX.data(), refY.data());
+
+        double largest = 0.0, error = 0.0;
+        for (size_t i = 0; i < n; i++) {
+          largest = max(largest, hypot(refX[i], refY[i]));
+          error = max(error, hypot(ax[i] - refX[i], ay[i] - refY[i]));
+        }
+        if (largest > 0.0)
+          worst = max(worst, error / largest);
+      }
+    }
+
+    bool ok = worst <= tolerance;
+    passed = passed && ok;
+    cout << "gravity kernel " << info.name << ": max relative error " << worst << (ok ? "" : " FAILED")
+         << endl;
+  }
+
+  return passed;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// adds to ax/ay the softened acceleration every source exerts on every target, without the factor G.
+// a source sitting exactly on a target contributes nothing, so the targets may be part of the sources
+using GravityKernel = void (*)(const float *tx, const float *ty, size_t targetCount, const float *sx,
+                               const float *sy, const float *sm, size_t sourceCount, float eps2, float *ax,
+                               float *ay);
+
+struct GravityKernelInfo {
+  const char *name;
+  GravityKernel kernel;
+};
+
+// kernels this CPU can run, widest first
+std::vector<GravityKernelInfo> supportedGravityKernels();
+
+// dispatches to the widest supported kernel, picked once from CPUID
+void directAccelerations(const float *tx, const float *ty, size_t targetCount, const float *sx,
+                         const float *sy, const float *sm, size_t sourceCount, float eps2, float *ax,
+                         float *ay);
+
+// the same sum in double precision, slow, only for checking the kernels
+void directAccelerationsReference(const float *tx, const float *ty, size_t targetCount, const float *sx,
+                                  const float *sy, const float *sm, size_t sourceCount, double eps2,
+                                  double *ax, double *ay);
+
+// runs every supported kernel against the reference on random clouds, prints the errors and returns false
+// if any kernel is off by more than float round-off
+bool checkGravityKernels();
@@ -0,0 +1,259 @@
+#include "engine.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <vulkan/vulkan_core.h>
+
+using namespace std;
+
+void VulkanEngine::createOffscreenTarget() {
+  // match the format the windowed path prefers so readbacks look like what would be presented
+  swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
+  swapChainExtent = {static_cast<uint32_t>(width), static_cast<uint32_t>(height)};
+
+  // one target per frame in flight, so copying frame N out never blocks rendering frame N+1
+  swapChainImages.resize(max_inflight_frames);
+  offscreenImageMemory.resize(max_inflight_frames);
+
+  for (size_t i = 0; i < swapChainImages.size(); i++) {
+    createImage(swapChainExtent, swapChainImageFormat,
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, swapChainImages[i],
+                offscreenImageMemory[i], allocator);
+  }
+}
+
+void VulkanEngine::cleanupOffscreenTarget() {
+  for (size_t i = 0; i < swapChainImages.size(); i++) {
+    destroyImage(swapChainImages[i], offscreenImageMemory[i], allocator);
+  }
+}
+
+void VulkanEngine::createReadbackBuffers() {
+  VkDeviceSize frameSize = 4 * static_cast<VkDeviceSize>(swapChainExtent.width) * swapChainExtent.height;
+
+  readbackBuffers.resize(max_inflight_frames);
+  readbackMemory.resize(max_inflight_frames);
+  pendingReadbacks.assign(max_inflight_frames, nullopt);
+
+  for (size_t i = 0; i < readbackBuffers.size(); i++) {
+    createBuffer(frameSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 readbackBuffers[i], readbackMemory[i], allocator);
+  }
+}
+
+void VulkanEngine::recordReadback(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+  // the render pass leaves the target in TRANSFER_SRC_OPTIMAL
+  VkBufferImageCopy region{
+      .bufferOffset = 0,
+      .bufferRowLength = 0,
+      .bufferImageHeight = 0,
+      .imageSubresource = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                           .mipLevel = 0,
+                           .baseArrayLayer = 0,
+                           .layerCount = 1},
+      .imageOffset = {0, 0, 0},
+      .imageExtent = {swapChainExtent.width, swapChainExtent.height, 1},
+  };
+
+  vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                         readbackBuffers[imageIndex], 1, &region);
+
+  // make the copy visible to the host once the frame's fence signals
+  VkBufferMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .buffer = readbackBuffers[imageIndex],
+      .offset = 0,
+      .size = VK_WHOLE_SIZE,
+  };
+
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0,
+                       nullptr, 1, &barrier, 0, nullptr);
+}
+
+void VulkanEngine::consumeReadback(uint32_t slot) {
+  if (!pendingReadbacks[slot].has_value())
+    return;
+
+  if (onFrameReadback)
+    onFrameReadback(static_cast<const uint8_t *>(readbackMemory[slot].mapped), swapChainExtent,
+                    pendingReadbacks[slot].value());
+
+  pendingReadbacks[slot] = nullopt;
+}
+
+void VulkanEngine::drawFrameHeadless() {
+  ProfileScope frameScope(profiler, "drawFrame");
+
+  {
+    ProfileScope scope(profiler, "fence wait");
+    vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+  }
+  profiler.collect(currentFrame);
+
+  // the frame submitted max_inflight_frames ago has landed in this slot's readback buffer
+  consumeReadback(currentFrame);
+
+  vkResetFences(device, 1, &inFlightFences[currentFrame]);
+
+  rigidBodyManager.syncInstances(currentFrame);
+
+  // each frame in flight owns its own target, so the image index is just the frame slot
+  uint64_t uploads;
+  {
+    ProfileScope scope(profiler, "record");
+    vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+    uploads = recordCommandBuffer(commandBuffers[currentFrame], currentFrame);
+  }
+
+  vector<VkSemaphore> waitSemaphores;
+  vector<VkPipelineStageFlags> waitStages;
+  vector<uint64_t> waitValues;
+  if (simulation == SimulationBackend::Gpu) {
+    waitSemaphores.push_back(submitComputeStep(currentFrame));
+    waitStages.push_back(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    waitValues.push_back(0);
+  }
+  if (uploads > 0) {
+    waitSemaphores.push_back(staging.getTimeline());
+    waitStages.push_back(StagingRing::consumerStages);
+    waitValues.push_back(uploads);
+  }
+
+  VkTimelineSemaphoreSubmitInfo timelineInfo{
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size()),
+      .pWaitSemaphoreValues = waitValues.data(),
+  };
+
+  VkSubmitInfo submitInfo{
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .pNext = &timelineInfo,
+      .waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size()),
+      .pWaitSemaphores = waitSemaphores.data(),
+      .pWaitDstStageMask = waitStages.data(),
+      .commandBufferCount = 1,
+      .pCommandBuffers = &commandBuffers[currentFrame],
+  };
+
+  if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
+    throw runtime_error("failed to submit draw command buffer!");
+  }
+  profiler.markSubmitted(currentFrame);
+  submittedFrames++;
+
+  pendingReadbacks[currentFrame] = frameNumber++;
+
+  currentFrame = (currentFrame + 1) % max_inflight_frames;
+}
+
+void VulkanEngine::headlessLoop() {
+  auto start = chrono::steady_clock::now();
+
+  frameSeconds.reserve(headlessFrameCount);
+  stepSeconds.reserve(headlessFrameCount);
+
+  // one step per frame without the simulation thread, a given frame count always renders the same states
+  auto frameStart = start;
+  for (uint32_t i = 0; i < headlessFrameCount; i++) {
+    if (simulation == SimulationBackend::Cpu) {
+      stepSimulation();
+      stepSeconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - frameStart).count());
+    }
+    drawFrameHeadless();
+
+    auto frameEnd = chrono::steady_clock::now();
+    frameSeconds.push_back(chrono::duration<double>(frameEnd - frameStart).count());
+    frameStart = frameEnd;
+  }
+
+  vkDeviceWaitIdle(device);
+
+  auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  if (!perfReportPath.empty())
+    writePerfReport(perfReportPath);
+
+  // the last frame submitted sits in the slot right before currentFrame
+  uint32_t lastSlot = (currentFrame + max_inflight_frames - 1) % max_inflight_frames;
+  if (!headlessOutputPath.empty() && pendingReadbacks[lastSlot].has_value()) {
+    savePPM(headlessOutputPath, static_cast<const uint8_t *>(readbackMemory[lastSlot].mapped),
+            swapChainExtent, swapChainImageFormat == VK_FORMAT_B8G8R8A8_SRGB);
+  }
+
+  // drain the ring oldest first
+  for (uint32_t i = 0; i < max_inflight_frames; i++) {
+    consumeReadback((currentFrame + i) % max_inflight_frames);
+  }
+
+  cout << "headless: " << headlessFrameCount << " frames in " << elapsed * 1000.0 << " ms ("
+       << headlessFrameCount / elapsed << " fps)" << endl;
+}
+
+// nearest rank of a copy the caller has sorted, in whole microseconds
+static long long percentileUs(const vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t rank = static_cast<size_t>(ceil(p / 100.0 * sorted.size()));
+  return llround(1e6 * sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1]);
+}
+
+// one flat object per run, cmake/perf_suite.cmake merges the runs and compares them against the baseline.
+// integers only, so the comparison can stay in cmake math
+void VulkanEngine::writePerfReport(const string &path) {
+  // every frame slot records its secondaries and the first uploads land in the first frames, startup_us
+  // already covers that
+  size_t warmup = min<size_t>(max_inflight_frames, frameSeconds.size() / 2);
+  vector<double> frames(frameSeconds.begin() + warmup, frameSeconds.end());
+  vector<double> steps(stepSeconds.begin() + min(warmup, stepSeconds.size()), stepSeconds.end());
+  sort(frames.begin(), frames.end());
+  sort(steps.begin(), steps.end());
+
+  AllocatorStats memory = allocator.stats();
+  // the instance copies are written straight into mapped memory, everything else goes through the ring
+  uint64_t uploadBytes = staging.getStagedBytes() + rigidBodyManager.syncedBytes;
+
+  ofstream file(path);
+  if (!file.is_open()) {
+    throw runtime_error("failed to open perf report!");
+  }
+
+  file << "{\"scene\": \"" << (simulation == SimulationBackend::None ? "grid" : "orbit") << "\", "
+       << "\"bodies\": " << (simulation == SimulationBackend::None ? gridBodyCount : simulatedBodyCount)
+       << ", \"frames\": " << frameSeconds.size() << ",\n"
+       << " \"startup_us\": " << llround(1e6 * startupSeconds) << ",\n"
+       << " \"frame_us_p50\": " << percentileUs(frames, 50) << ", \"frame_us_p90\": "
+       << percentileUs(frames, 90) << ", \"frame_us_p99\": " << percentileUs(frames, 99)
+       << ", \"frame_us_max\": " << percentileUs(frames, 100) << ",\n"
+       << " \"sim_step_us_p50\": " << percentileUs(steps, 50) << ", \"sim_step_us_p99\": "
+       << percentileUs(steps, 99) << ",\n"
+       << " \"upload_bytes\": " << uploadBytes << ", \"gpu_memory_bytes\": " << memory.reserved
+       << ", \"gpu_memory_used_bytes\": " << memory.used << "}\n";
+
+  cout << "perf report written to " << path << endl;
+}
+
+void savePPM(const std::string &filename, const uint8_t *pixels, VkExtent2D extent, bool bgra) {
+  ofstream file(filename, ios::binary);
+
+  if (!file.is_open()) {
+    throw runtime_error("failed to open file!");
+  }
+
+  file << "P6\n" << extent.width << " " << extent.height << "\n255\n";
+
+  vector<uint8_t> row(3 * extent.width);
+  for (uint32_t y = 0; y < extent.height; y++) {
+    const uint8_t *src = pixels + 4 * static_cast<size_t>(y) * extent.width;
+    for (uint32_t x = 0; x < extent.width; x++) {
+      row[3 * x + 0] = src[4 * x + (bgra ? 2 : 0)];
+      row[3 * x + 1] = src[4 * x + 1];
+      row[3 * x + 2] = src[4 * x + (bgra ? 0 : 2)];
+    }
+    file.write(reinterpret_cast<const char *>(row.data()), row.size());
+  }
+}
@@ -0,0 +1,193 @@
+#include "integrator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+// GCC lowers these to whatever vector width the clone below is compiled for
+static const int lanes = 4;
+typedef double doublev __attribute__((vector_size(lanes * sizeof(double))));
+typedef int64_t maskv __attribute__((vector_size(lanes * sizeof(int64_t))));
+
+// Dormand-Prince tableau, the 5th order solution is the last row of a so the final stage is reused as the
+// first stage of the next step
+static const double a21 = 1.0 / 5.0;
+static const double a31 = 3.0 / 40.0, a32 = 9.0 / 40.0;
+static const double a41 = 44.0 / 45.0, a42 = -56.0 / 15.0, a43 = 32.0 / 9.0;
+static const double a51 = 19372.0 / 6561.0, a52 = -25360.0 / 2187.0, a53 = 64448.0 / 6561.0,
+                    a54 = -212.0 / 729.0;
+static const double a61 = 9017.0 / 3168.0, a62 = -355.0 / 33.0, a63 = 46732.0 / 5247.0, a64 = 49.0 / 176.0,
+                    a65 = -5103.0 / 18656.0;
+static const double b1 = 35.0 / 384.0, b3 = 500.0 / 1113.0, b4 = 125.0 / 192.0, b5 = -2187.0 / 6784.0,
+                    b6 = 11.0 / 84.0;
+// difference between the 5th and the embedded 4th order weights
+static const double e1 = 71.0 / 57600.0, e3 = -71.0 / 16695.0, e4 = 71.0 / 1920.0, e5 = -17253.0 / 339200.0,
+                    e6 = 22.0 / 525.0, e7 = -1.0 / 40.0;
+
+// always inlined so the vectors never cross a call between the avx2 clone and default code, which pass
+// them differently. results go out through a reference, returning a 256 bit vector by value without avx
+// changes the ABI
+#define VECTOR_HELPER static inline __attribute__((always_inline))
+VECTOR_HELPER void acceleration(const doublev &u, doublev &out) { out = 3.0 * u * u - u; }
+// max(|a|, |b|) per lane
+VECTOR_HELPER void largerMagnitude(const doublev &a, const doublev &b, doublev &out) {
+  doublev absA = a < 0.0 ? -a : a, absB = b < 0.0 ? -b : b;
+  out = absA > absB ? absA : absB;
+}
+
+// the lane arrays are plain doubles, std::vector does not keep a vector type's alignment
+VECTOR_HELPER void load(const double *p, doublev &out) { memcpy(&out, p, sizeof(out)); }
+VECTOR_HELPER void store(double *p, const doublev &v) { memcpy(p, &v, sizeof(v)); }
+
+// state of the lanes still running, packed to the front so finished lanes cost nothing. the arrays are
+// padded to whole blocks and unused slots hold u = w = 0, which stays put
+struct PackedLanes {
+  vector<double> u, w, acc, phi, h;
+  vector<uint32_t> lane;
+  size_t count = 0;
+
+  size_t blocks() const { return (count + lanes - 1) / lanes; }
+
+  void move(size_t from, size_t to) {
+    u[to] = u[from];
+    w[to] = w[from];
+    acc[to] = acc[from];
+    phi[to] = phi[from];
+    h[to] = h[from];
+    lane[to] = lane[from];
+  }
+
+  void clear(size_t slot) { u[slot] = w[slot] = acc[slot] = 0.0; }
+};
+
+// one attempted step for every packed lane, rejected lanes keep their state and retry with a smaller step
+__attribute__((target_clones("avx2", "default"))) static void step(PackedLanes &packed,
+                                                                  const IntegratorSettings &settings) {
+  const double escapeU = 1.0 / settings.escapeRadius;
+
+  for (size_t block = 0; block < packed.blocks(); block++) {
+    const size_t first = block * lanes;
+    doublev u, w, a1, h;
+    load(&packed.u[first], u);
+    load(&packed.w[first], w);
+    load(&packed.acc[first], a1);
+    load(&packed.h[first], h);
+
+    // (u, w)' = (w, 3u^2 - u), so the u slope of each stage is its w
+    doublev u2 = u + h * (a21 * w);
+    doublev w2 = w + h * (a21 * a1);
+    doublev a2;
+    acceleration(u2, a2);
+    doublev u3 = u + h * (a31 * w + a32 * w2);
+    doublev w3 = w + h * (a31 * a1 + a32 * a2);
+    doublev a3;
+    acceleration(u3, a3);
+    doublev u4 = u + h * (a41 * w + a42 * w2 + a43 * w3);
+    doublev w4 = w + h * (a41 * a1 + a42 * a2 + a43 * a3);
+    doublev a4;
+    acceleration(u4, a4);
+    doublev u5 = u + h * (a51 * w + a52 * w2 + a53 * w3 + a54 * w4);
+    doublev w5 = w + h * (a51 * a1 + a52 * a2 + a53 * a3 + a54 * a4);
+    doublev a5;
+    acceleration(u5, a5);
+    doublev u6 = u + h * (a61 * w + a62 * w2 + a63 * w3 + a64 * w4 + a65 * w5);
+    doublev w6 = w + h * (a61 * a1 + a62 * a2 + a63 * a3 + a64 * a4 + a65 * a5);
+    doublev a6;
+    acceleration(u6, a6);
+
+    doublev nextU = u + h * (b1 * w + b3 * w3 + b4 * w4 + b5 * w5 + b6 * w6);
+    doublev nextW = w + h * (b1 * a1 + b3 * a3 + b4 * a4 + b5 * a5 + b6 * a6);
+    doublev nextA;
+    acceleration(nextU, nextA);
+
+    doublev errorU = h * (e1 * w + e3 * w3 + e4 * w4 + e5 * w5 + e6 * w6 + e7 * nextW);
+    doublev errorW = h * (e1 * a1 + e3 * a3 + e4 * a4 + e5 * a5 + e6 * a6 + e7 * nextA);
+    doublev sizeU, sizeW, error;
+    largerMagnitude(u, nextU, sizeU);
+    largerMagnitude(w, nextW, sizeW);
+    doublev scaleU = settings.absoluteTolerance + settings.relativeTolerance * sizeU;
+    doublev scaleW = settings.absoluteTolerance + settings.relativeTolerance * sizeW;
+    // the scales are positive, so this is the larger of the two scaled error magnitudes
+    largerMagnitude(errorU / scaleU, errorW / scaleW, error);
+
+    maskv accept = error <= 1.0;
+    doublev phi;
+    load(&packed.phi[first], phi);
+    store(&packed.u[first], accept ? nextU : u);
+    store(&packed.w[first], accept ? nextW : w);
+    store(&packed.acc[first], accept ? nextA : a1);
+    store(&packed.phi[first], accept ? phi + h : phi);
+
+    for (int l = 0; l < lanes; l++) {
+      // the usual 0.9 err^(-1/5) controller, growth and shrink bounded to 5x
+      double factor = error[l] > 0.0 ? clamp(0.9 * pow(error[l], -0.2), 0.2, 5.0) : 5.0;
+      double next = min(h[l] * factor, settings.maxStep);
+
+      // land an outgoing path inside the escape radius instead of far past it, the analytic tail is only
+      // exact for small u
+      double lu = packed.u[first + l], lw = packed.w[first + l];
+      if (lw < 0.0 && lu > escapeU)
+        next = min(next, max((lu - 0.5 * escapeU) / -lw, settings.absoluteTolerance));
+      packed.h[first + l] = next;
+    }
+  }
+}
+
+uint64_t integrateGeodesics(GeodesicBatch &batch, const IntegratorSettings &settings) {
+  const size_t count = batch.size();
+  const double escapeU = 1.0 / settings.escapeRadius;
+
+  batch.sweep.assign(count, 0.0);
+  batch.fate.assign(count, GeodesicFate::Trapped);
+  batch.steps.assign(count, 0);
+
+  PackedLanes packed;
+  size_t padded = (count + lanes - 1) / lanes * lanes;
+  packed.u.assign(padded, 0.0);
+  packed.w.assign(padded, 0.0);
+  packed.acc.assign(padded, 0.0);
+  packed.phi.assign(padded, 0.0);
+  packed.h.assign(padded, settings.initialStep);
+  packed.lane.resize(count);
+  packed.count = count;
+
+  for (size_t i = 0; i < count; i++) {
+    packed.u[i] = batch.u[i];
+    packed.w[i] = batch.w[i];
+    packed.acc[i] = 3.0 * batch.u[i] * batch.u[i] - batch.u[i];
+    packed.lane[i] = static_cast<uint32_t>(i);
+  }
+
+  uint64_t total = 0;
+  for (uint32_t iteration = 1; packed.count > 0; iteration++) {
+    step(packed, settings);
+    total += packed.count;
+
+    // walk down so the lane swapped into a finished slot has already been checked
+    for (size_t i = packed.count; i-- > 0;) {
+      double u = packed.u[i], w = packed.w[i], phi = packed.phi[i];
+      uint32_t lane = packed.lane[i];
+
+      if (w < 0.0 && u <= escapeU) {
+        // far out u'' = -u, so u = u cos t + w sin t reaches zero after atan2(u, -w)
+        batch.fate[lane] = GeodesicFate::Escaped;
+        batch.sweep[lane] = phi + atan2(u, -w);
+      } else if (u >= 0.5 || (u > 1.0 / 3.0 && w > 0.0)) {
+        // falling inward inside the photon sphere, u'' > 0 from here to the horizon
+        batch.fate[lane] = GeodesicFate::Captured;
+      } else if (phi >= settings.maxSweep) {
+        batch.fate[lane] = GeodesicFate::Trapped;
+      } else {
+        continue;
+      }
+
+      batch.steps[lane] = iteration;
+      packed.count--;
+      packed.move(packed.count, i);
+      packed.clear(packed.count);
+    }
+  }
+
+  return total;
+}
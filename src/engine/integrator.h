@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// adaptive Dormand-Prince 5(4) integration of Schwarzschild light paths in the Binet form
+// u'' = 3 u^2 - u over the swept angle, u = 1 / r in units of the black hole mass
+
+struct IntegratorSettings {
+  // per-step error bound on u and du/dphi
+  double relativeTolerance = 1e-9;
+  double absoluteTolerance = 1e-12;
+  double initialStep = 1e-2;
+  double maxStep = 0.5;
+  // paths still circling the photon sphere after this much sweep are reported as trapped
+  double maxSweep = 6.0 * 3.14159265358979323846;
+  // outgoing paths past this radius are finished analytically, the 3 u^2 term is negligible out there
+  double escapeRadius = 1e4;
+};
+
+enum class GeodesicFate : uint8_t { Escaped, Captured, Trapped };
+
+// one path per lane, kept as separate arrays so every stage runs across several lanes at once
+struct GeodesicBatch {
+  // initial state, u = 1 / r and w = du/dphi (positive while falling inward)
+  std::vector<double> u, w;
+
+  // filled by integrateGeodesics: the angle swept until r reaches infinity (escaped lanes only), the fate
+  // and the number of attempted steps of every lane
+  std::vector<double> sweep;
+  std::vector<GeodesicFate> fate;
+  std::vector<uint32_t> steps;
+
+  size_t size() const { return u.size(); }
+};
+
+// advances every lane until it escapes, crosses the photon sphere inward or runs out of sweep. returns the
+// steps summed over lanes
+uint64_t integrateGeodesics(GeodesicBatch &batch, const IntegratorSettings &settings = {});
@@ -0,0 +1,433 @@
+#include "engine.h"
+#include "spirv.h"
+#include <algorithm>
+#include <glm/gtc/packing.hpp>
+#include <vulkan/vulkan_core.h>
+
+using namespace std;
+
+// the table spans every observer distance we accept, so moving the camera never needs a rebuild
+static const uint32_t impactSamples = 1024, distanceSamples = 64;
+static const float maxTableImpact = 64.0f;
+static const float minObserverDistance = 4.0f, maxObserverDistance = 1e4f;
+
+void VulkanEngine::createLensingResources() {
+  VkAttachmentDescription colorAttachment{.format = swapChainImageFormat,
+                                          .samples = VK_SAMPLE_COUNT_1_BIT,
+                                          .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+                                          .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+                                          .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+                                          .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+                                          .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                                          .finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+
+  VkAttachmentReference colorAttachmentRef{.attachment = 0,
+                                           .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+
+  VkSubpassDescription subpass{
+      .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+      .colorAttachmentCount = 1,
+      .pColorAttachments = &colorAttachmentRef,
+  };
+
+  // the lens pass samples the scene right after this pass writes it
+  array<VkSubpassDependency, 2> dependencies{};
+  dependencies[0] = {
+      .srcSubpass = VK_SUBPASS_EXTERNAL,
+      .dstSubpass = 0,
+      .srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      .srcAccessMask = 0,
+      .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+  };
+  dependencies[1] = {
+      .srcSubpass = 0,
+      .dstSubpass = VK_SUBPASS_EXTERNAL,
+      .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      .dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+  };
+
+  VkRenderPassCreateInfo renderPassInfo{
+      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+      .attachmentCount = 1,
+      .pAttachments = &colorAttachment,
+      .subpassCount = 1,
+      .pSubpasses = &subpass,
+      .dependencyCount = static_cast<uint32_t>(dependencies.size()),
+      .pDependencies = dependencies.data(),
+  };
+
+  // same single attachment format as renderPass, so graphicsPipeline is compatible with both
+  if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &sceneRenderPass) != VK_SUCCESS) {
+    throw runtime_error("failed to create scene render pass!");
+  }
+
+  VkSamplerCreateInfo samplerInfo{
+      .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+      .magFilter = VK_FILTER_LINEAR,
+      .minFilter = VK_FILTER_LINEAR,
+      .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+      .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .maxLod = 0.0f,
+  };
+
+  if (vkCreateSampler(device, &samplerInfo, nullptr, &lensingSampler) != VK_SUCCESS) {
+    throw runtime_error("failed to create lensing sampler!");
+  }
+
+  array<VkDescriptorSetLayoutBinding, 2> bindings{};
+  for (uint32_t i = 0; i < bindings.size(); i++) {
+    bindings[i] = {.binding = i,
+                   .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                   .descriptorCount = 1,
+                   .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT};
+  }
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo{
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(bindings.size()),
+      .pBindings = bindings.data(),
+  };
+
+  if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &lensingDescriptorSetLayout) != VK_SUCCESS) {
+    throw runtime_error("failed to create lensing descriptor set layout!");
+  }
+
+  uint32_t frames = static_cast<uint32_t>(max_inflight_frames);
+  VkDescriptorPoolSize poolSize{.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                .descriptorCount = 2 * frames};
+
+  VkDescriptorPoolCreateInfo poolInfo{
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = frames,
+      .poolSizeCount = 1,
+      .pPoolSizes = &poolSize,
+  };
+
+  if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &lensingDescriptorPool) != VK_SUCCESS) {
+    throw runtime_error("failed to create lensing descriptor pool!");
+  }
+
+  vector<VkDescriptorSetLayout> layouts(frames, lensingDescriptorSetLayout);
+  lensingDescriptorSets.resize(frames);
+
+  VkDescriptorSetAllocateInfo allocInfo{
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = lensingDescriptorPool,
+      .descriptorSetCount = frames,
+      .pSetLayouts = layouts.data(),
+  };
+
+  if (vkAllocateDescriptorSets(device, &allocInfo, lensingDescriptorSets.data()) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate lensing descriptor sets!");
+  }
+
+  createDeflectionImage();
+  createLensingPipeline();
+}
+
+void VulkanEngine::createDeflectionImage() {
+  deflectionTable = DeflectionTable::build(impactSamples, distanceSamples, maxTableImpact,
+                                           minObserverDistance, maxObserverDistance);
+
+  // half floats keep a few radians of deflection to ~1e-3 and halve the fetch size
+  vector<uint16_t> texels(deflectionTable.texels.size());
+  for (size_t i = 0; i < texels.size(); i++) {
+    texels[i] = glm::packHalf1x16(deflectionTable.texels[i]);
+  }
+
+  VkDeviceSize imageSize = texels.size() * sizeof(uint16_t);
+
+  VkDeviceSize stagingOffset = staging.stage(texels.data(), imageSize);
+
+  VkExtent2D extent{deflectionTable.impactSamples, deflectionTable.distanceSamples};
+  createImage(extent, VK_FORMAT_R16G16_SFLOAT, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+              deflectionImage, deflectionImageMemory, allocator);
+
+  VkImageMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = 0,
+      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = deflectionImage,
+      .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                           .baseMipLevel = 0,
+                           .levelCount = 1,
+                           .baseArrayLayer = 0,
+                           .layerCount = 1},
+  };
+
+  VkBufferImageCopy region{
+      .bufferOffset = stagingOffset,
+      .bufferRowLength = 0,
+      .bufferImageHeight = 0,
+      .imageSubresource = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                           .mipLevel = 0,
+                           .baseArrayLayer = 0,
+                           .layerCount = 1},
+      .imageOffset = {0, 0, 0},
+      .imageExtent = {extent.width, extent.height, 1},
+  };
+
+  VkCommandBuffer commandBuffer = staging.commandBuffer();
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+  vkCmdCopyBufferToImage(commandBuffer, staging.getBuffer(), deflectionImage,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+  // the first frame acquires it on the graphics queue
+  staging.releaseImage(deflectionImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  staging.submit();
+
+  deflectionImageView = createImageView(deflectionImage, VK_FORMAT_R16G16_SFLOAT, &device);
+}
+
+void VulkanEngine::createLensingPipeline() {
+  VkShaderModule vertShaderModule = createShaderModule(spirv::lensing_vert, sizeof(spirv::lensing_vert));
+  VkShaderModule fragShaderModule = createShaderModule(spirv::lensing_frag, sizeof(spirv::lensing_frag));
+
+  // the table is built before the pipeline, its layout goes in as constants
+  SpecializationConstants tableConstants;
+  tableConstants.set(0, static_cast<float>(deflectionTable.impactSamples))
+      .set(1, static_cast<float>(deflectionTable.distanceSamples))
+      .set(2, deflectionTable.maxImpact)
+      .set(3, deflectionTable.minLogDistance)
+      .set(4, deflectionTable.maxLogDistance);
+
+  VkPipelineShaderStageCreateInfo shaderStages[] = {
+      {.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+       .stage = VK_SHADER_STAGE_VERTEX_BIT,
+       .module = vertShaderModule,
+       .pName = "main"},
+      {.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+       .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+       .module = fragShaderModule,
+       .pName = "main",
+       .pSpecializationInfo = tableConstants.get()},
+  };
+
+  vector<VkDynamicState> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+  VkPipelineDynamicStateCreateInfo dynamicState{.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+                                                .dynamicStateCount =
+                                                    static_cast<uint32_t>(dynamicStates.size()),
+                                                .pDynamicStates = dynamicStates.data()};
+
+  // the full-screen triangle is generated from gl_VertexIndex
+  VkPipelineVertexInputStateCreateInfo vertexInputInfo{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO};
+
+  VkPipelineInputAssemblyStateCreateInfo inputAssembly{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+      .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+      .primitiveRestartEnable = VK_FALSE};
+
+  VkPipelineViewportStateCreateInfo viewportState{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO, .viewportCount = 1, .scissorCount = 1};
+
+  VkPipelineRasterizationStateCreateInfo rasterizer{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+      .depthClampEnable = VK_FALSE,
+      .rasterizerDiscardEnable = VK_FALSE,
+      .polygonMode = VK_POLYGON_MODE_FILL,
+      .cullMode = VK_CULL_MODE_NONE,
+      .frontFace = VK_FRONT_FACE_CLOCKWISE,
+      .depthBiasEnable = VK_FALSE,
+      .lineWidth = 1.0f};
+
+  VkPipelineMultisampleStateCreateInfo multisampling{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+      .sampleShadingEnable = VK_FALSE};
+
+  VkPipelineColorBlendAttachmentState colorBlendAttachment{
+      .blendEnable = VK_FALSE,
+      .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT |
+                        VK_COLOR_COMPONENT_A_BIT};
+
+  VkPipelineColorBlendStateCreateInfo colorBlending{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+      .logicOpEnable = VK_FALSE,
+      .attachmentCount = 1,
+      .pAttachments = &colorBlendAttachment};
+
+  VkPushConstantRange lensRange{
+      .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT, .offset = 0, .size = sizeof(LensingPushConstants)};
+
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                                                .setLayoutCount = 1,
+                                                .pSetLayouts = &lensingDescriptorSetLayout,
+                                                .pushConstantRangeCount = 1,
+                                                .pPushConstantRanges = &lensRange};
+
+  if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &lensingPipelineLayout) != VK_SUCCESS) {
+    throw runtime_error("failed to create lensing pipeline layout!");
+  }
+
+  VkGraphicsPipelineCreateInfo pipelineInfo{
+      .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+      .stageCount = 2,
+      .pStages = shaderStages,
+      .pVertexInputState = &vertexInputInfo,
+      .pInputAssemblyState = &inputAssembly,
+      .pViewportState = &viewportState,
+      .pRasterizationState = &rasterizer,
+      .pMultisampleState = &multisampling,
+      .pColorBlendState = &colorBlending,
+      .pDynamicState = &dynamicState,
+      .layout = lensingPipelineLayout,
+      .renderPass = renderPass,
+      .subpass = 0,
+  };
+
+  auto compileStart = chrono::steady_clock::now();
+  if (vkCreateGraphicsPipelines(device, pipelineCache.get(), 1, &pipelineInfo, nullptr, &lensingPipeline) !=
+      VK_SUCCESS) {
+    throw runtime_error("failed to create lensing pipeline!");
+  }
+  pipelineCache.recordCompile(compileStart);
+
+  vkDestroyShaderModule(device, fragShaderModule, nullptr);
+  vkDestroyShaderModule(device, vertShaderModule, nullptr);
+}
+
+// sized to the swapchain, one per frame slot
+void VulkanEngine::createLensingTargets() {
+  sceneImages.resize(max_inflight_frames);
+  sceneImageMemory.resize(max_inflight_frames);
+  sceneImageViews.resize(max_inflight_frames);
+  sceneFramebuffers.resize(max_inflight_frames);
+  lensingTargetVersions.assign(max_inflight_frames, swapchainVersion);
+
+  for (uint32_t i = 0; i < max_inflight_frames; i++) {
+    createLensingTarget(i);
+  }
+}
+
+void VulkanEngine::createLensingTarget(uint32_t slot) {
+  createImage(swapChainExtent, swapChainImageFormat,
+              VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, sceneImages[slot],
+              sceneImageMemory[slot], allocator);
+  sceneImageViews[slot] = createImageView(sceneImages[slot], swapChainImageFormat, &device);
+
+  VkFramebufferCreateInfo framebufferInfo{
+      .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+      .renderPass = sceneRenderPass,
+      .attachmentCount = 1,
+      .pAttachments = &sceneImageViews[slot],
+      .width = swapChainExtent.width,
+      .height = swapChainExtent.height,
+      .layers = 1,
+  };
+
+  if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &sceneFramebuffers[slot]) != VK_SUCCESS) {
+    throw runtime_error("failed to create scene framebuffer!");
+  }
+
+  VkDescriptorImageInfo sceneInfo{.sampler = lensingSampler,
+                                  .imageView = sceneImageViews[slot],
+                                  .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+  VkDescriptorImageInfo tableInfo{.sampler = lensingSampler,
+                                  .imageView = deflectionImageView,
+                                  .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+
+  array<VkWriteDescriptorSet, 2> writes{};
+  writes[0] = {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+               .dstSet = lensingDescriptorSets[slot],
+               .dstBinding = 0,
+               .descriptorCount = 1,
+               .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+               .pImageInfo = &sceneInfo};
+  writes[1] = {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+               .dstSet = lensingDescriptorSets[slot],
+               .dstBinding = 1,
+               .descriptorCount = 1,
+               .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+               .pImageInfo = &tableInfo};
+
+  vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
+// the slot's fence has signalled, so neither its scene pass nor its lensing pass still uses the old target
+// or descriptor set
+void VulkanEngine::refreshLensingTarget(uint32_t slot) {
+  if (lensingTargetVersions[slot] == swapchainVersion)
+    return;
+
+  destroyLensingTarget(slot);
+  createLensingTarget(slot);
+  lensingTargetVersions[slot] = swapchainVersion;
+}
+
+void VulkanEngine::recordLensingPass(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+  VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
+  VkRenderPassBeginInfo renderPassInfo{
+      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+      .renderPass = renderPass,
+      .framebuffer = swapChainFramebuffers[imageIndex],
+      .renderArea = {.offset = {0, 0}, .extent = swapChainExtent},
+      .clearValueCount = 1,
+      .pClearValues = &clearColor,
+  };
+
+  vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, lensingPipeline);
+
+  VkViewport viewport{.x = 0.0f,
+                      .y = 0.0f,
+                      .width = static_cast<float>(swapChainExtent.width),
+                      .height = static_cast<float>(swapChainExtent.height),
+                      .minDepth = 0.0f,
+                      .maxDepth = 1.0f};
+  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+  VkRect2D scissor{.offset = {0, 0}, .extent = swapChainExtent};
+  vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, lensingPipelineLayout, 0, 1,
+                          &lensingDescriptorSets[currentFrame], 0, nullptr);
+
+  LensingPushConstants lens{
+      .observerDistance = std::clamp(lensCamera.observerDistance, minObserverDistance, maxObserverDistance),
+      .tanHalfFov = tanf(0.5f * lensCamera.fieldOfView),
+      .aspect = static_cast<float>(swapChainExtent.width) / swapChainExtent.height,
+  };
+  vkCmdPushConstants(commandBuffer, lensingPipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(lens),
+                     &lens);
+
+  vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+
+  vkCmdEndRenderPass(commandBuffer);
+}
+
+void VulkanEngine::destroyLensingTarget(uint32_t slot) {
+  vkDestroyFramebuffer(device, sceneFramebuffers[slot], nullptr);
+  vkDestroyImageView(device, sceneImageViews[slot], nullptr);
+  destroyImage(sceneImages[slot], sceneImageMemory[slot], allocator);
+}
+
+void VulkanEngine::cleanupLensingTargets() {
+  for (uint32_t i = 0; i < sceneImages.size(); i++) {
+    destroyLensingTarget(i);
+  }
+}
+
+void VulkanEngine::cleanupLensing() {
+  vkDestroyPipeline(device, lensingPipeline, nullptr);
+  vkDestroyPipelineLayout(device, lensingPipelineLayout, nullptr);
+  vkDestroyDescriptorPool(device, lensingDescriptorPool, nullptr);
+  vkDestroyDescriptorSetLayout(device, lensingDescriptorSetLayout, nullptr);
+  vkDestroySampler(device, lensingSampler, nullptr);
+
+  vkDestroyImageView(device, deflectionImageView, nullptr);
+  destroyImage(deflectionImage, deflectionImageMemory, allocator);
+
+  vkDestroyRenderPass(device, sceneRenderPass, nullptr);
+}
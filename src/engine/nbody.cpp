@@ -0,0 +1,318 @@
+#include "nbody.h"
+#include "gravity.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+void ParticleStore::add(float px, float py, float pvx, float pvy, float m) {
+  x.push_back(px);
+  y.push_back(py);
+  vx.push_back(pvx);
+  vy.push_back(pvy);
+  mass.push_back(m);
+  // accelerations are stale until the next force evaluation
+  ax.clear();
+  ay.clear();
+}
+
+void ParticleStore::clear() {
+  x.clear();
+  y.clear();
+  vx.clear();
+  vy.clear();
+  ax.clear();
+  ay.clear();
+  mass.clear();
+}
+
+// spreads the low 16 bits of v over the even bits of the result
+static uint32_t part1By1(uint32_t v) {
+  v &= 0x0000ffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+void BarnesHutSolver::sortByMortonCode(const ParticleStore &particles) {
+  size_t n = particles.size();
+
+  float minX = numeric_limits<float>::max(), minY = minX;
+  float maxX = numeric_limits<float>::lowest(), maxY = maxX;
+  for (size_t i = 0; i < n; i++) {
+    minX = min(minX, particles.x[i]);
+    maxX = max(maxX, particles.x[i]);
+    minY = min(minY, particles.y[i]);
+    maxY = max(maxY, particles.y[i]);
+  }
+
+  // square root cell, padded so the max corner still quantizes inside the grid
+  float side = max(max(maxX - minX, maxY - minY), numeric_limits<float>::min()) * 1.0001f;
+  float scale = 65535.0f / side;
+
+  codes.resize(n);
+  order.resize(n);
+  parallelFor(n, 4096, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      uint32_t qx = static_cast<uint32_t>((particles.x[i] - minX) * scale);
+      uint32_t qy = static_cast<uint32_t>((particles.y[i] - minY) * scale);
+      codes[i] = part1By1(qx) | (part1By1(qy) << 1);
+      order[i] = static_cast<uint32_t>(i);
+    }
+  });
+
+  // LSD radix sort, 8 bits per pass
+  scratchCodes.resize(n);
+  scratchOrder.resize(n);
+  for (uint32_t shift = 0; shift < 32; shift += 8) {
+    size_t offsets[257] = {};
+    for (size_t i = 0; i < n; i++) {
+      offsets[((codes[i] >> shift) & 0xff) + 1]++;
+    }
+    for (size_t b = 1; b < 257; b++) {
+      offsets[b] += offsets[b - 1];
+    }
+    for (size_t i = 0; i < n; i++) {
+      size_t dst = offsets[(codes[i] >> shift) & 0xff]++;
+      scratchCodes[dst] = codes[i];
+      scratchOrder[dst] = order[i];
+    }
+    codes.swap(scratchCodes);
+    order.swap(scratchOrder);
+  }
+
+  sx.resize(n);
+  sy.resize(n);
+  sm.resize(n);
+  parallelFor(n, 4096, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      sx[i] = particles.x[order[i]];
+      sy[i] = particles.y[order[i]];
+      sm[i] = particles.mass[order[i]];
+    }
+  });
+
+  nodes.clear();
+  leaves.clear();
+  nodes.push_back({.first = 0, .count = static_cast<uint32_t>(n), .firstChild = 0, .childCount = 0});
+}
+
+// opening distance from Barnes' offset criterion, size / theta plus the offset of the center of mass
+// from the box center, so lopsided cells are not accepted too early
+void BarnesHutSolver::finishNode(Node &node) const {
+  float centerX = 0.5f * (node.minX + node.maxX), centerY = 0.5f * (node.minY + node.maxY);
+  node.comX = node.mass > 0.0f ? node.comX / node.mass : centerX;
+  node.comY = node.mass > 0.0f ? node.comY / node.mass : centerY;
+
+  float size = max(node.maxX - node.minX, node.maxY - node.minY);
+  float offset = hypotf(node.comX - centerX, node.comY - centerY);
+  float radius = theta > 0.0f ? size / theta + offset : numeric_limits<float>::infinity();
+  node.openRadius2 = radius * radius;
+}
+
+void BarnesHutSolver::buildNode(uint32_t idx, uint32_t depth) {
+  uint32_t first = nodes[idx].first, count = nodes[idx].count;
+
+  // comX/comY accumulate mass-weighted positions until finishNode divides them out
+  Node bounds{.comX = 0.0f,
+              .comY = 0.0f,
+              .mass = 0.0f,
+              .minX = numeric_limits<float>::max(),
+              .minY = numeric_limits<float>::max(),
+              .maxX = numeric_limits<float>::lowest(),
+              .maxY = numeric_limits<float>::lowest()};
+
+  if (count > leafSize && depth < maxDepth) {
+    // children are the runs of equal quadrant digits at this depth, stored next to each other
+    uint32_t shift = 2 * (maxDepth - 1 - depth);
+    uint32_t firstChild = static_cast<uint32_t>(nodes.size());
+
+    uint32_t begin = first, end = first + count;
+    for (uint32_t q = 0; q < 4 && begin < end; q++) {
+      uint32_t split = static_cast<uint32_t>(
+          partition_point(codes.begin() + begin, codes.begin() + end,
+                          [&](uint32_t code) { return ((code >> shift) & 3) <= q; }) -
+          codes.begin());
+      if (split > begin) {
+        nodes.push_back({.first = begin, .count = split - begin, .firstChild = 0, .childCount = 0});
+      }
+      begin = split;
+    }
+
+    uint32_t childCount = static_cast<uint32_t>(nodes.size()) - firstChild;
+    nodes[idx].firstChild = firstChild;
+    nodes[idx].childCount = childCount;
+
+    for (uint32_t c = firstChild; c < firstChild + childCount; c++) {
+      buildNode(c, depth + 1);
+      const Node &child = nodes[c];
+      bounds.mass += child.mass;
+      bounds.comX += child.mass * child.comX;
+      bounds.comY += child.mass * child.comY;
+      bounds.minX = min(bounds.minX, child.minX);
+      bounds.minY = min(bounds.minY, child.minY);
+      bounds.maxX = max(bounds.maxX, child.maxX);
+      bounds.maxY = max(bounds.maxY, child.maxY);
+    }
+  } else {
+    leaves.push_back(idx);
+    for (uint32_t j = first; j < first + count; j++) {
+      bounds.mass += sm[j];
+      bounds.comX += sm[j] * sx[j];
+      bounds.comY += sm[j] * sy[j];
+      bounds.minX = min(bounds.minX, sx[j]);
+      bounds.minY = min(bounds.minY, sy[j]);
+      bounds.maxX = max(bounds.maxX, sx[j]);
+      bounds.maxY = max(bounds.maxY, sy[j]);
+    }
+  }
+
+  Node &node = nodes[idx];
+  node.comX = bounds.comX;
+  node.comY = bounds.comY;
+  node.mass = bounds.mass;
+  node.minX = bounds.minX;
+  node.minY = bounds.minY;
+  node.maxX = bounds.maxX;
+  node.maxY = bounds.maxY;
+  finishNode(node);
+}
+
+void BarnesHutSolver::InteractionList::clear() {
+  x.clear();
+  y.clear();
+  mass.clear();
+}
+
+void BarnesHutSolver::InteractionList::add(float px, float py, float m) {
+  x.push_back(px);
+  y.push_back(py);
+  mass.push_back(m);
+}
+
+// one walk per leaf instead of per particle, a cell is only accepted when it is far enough from every
+// point of the leaf's box, so the whole leaf can share the list
+void BarnesHutSolver::gatherInteractions(const Node &group, InteractionList &list) const {
+  list.clear();
+
+  // depth is bounded by maxDepth, each level pushes at most 4 children
+  uint32_t stack[4 * maxDepth + 4];
+  uint32_t top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    const Node &node = nodes[stack[--top]];
+    if (node.mass == 0.0f)
+      continue;
+
+    // distance from the center of mass to the closest point of the group, zero when it lies inside
+    float dx = max(max(group.minX - node.comX, node.comX - group.maxX), 0.0f);
+    float dy = max(max(group.minY - node.comY, node.comY - group.maxY), 0.0f);
+
+    if (dx * dx + dy * dy > node.openRadius2) {
+      list.add(node.comX, node.comY, node.mass);
+    } else if (node.childCount == 0) {
+      // massless particles exert nothing, leave them out of the sum
+      for (uint32_t j = node.first; j < node.first + node.count; j++) {
+        if (sm[j] != 0.0f)
+          list.add(sx[j], sy[j], sm[j]);
+      }
+    } else {
+      for (uint32_t c = 0; c < node.childCount; c++) {
+        stack[top++] = node.firstChild + c;
+      }
+    }
+  }
+}
+
+void BarnesHutSolver::computeDirect(ParticleStore &particles) {
+  size_t n = particles.size();
+  const float eps2 = softening * softening;
+
+  nodes.clear();
+  leaves.clear();
+
+  parallelFor(n, 256, [&](size_t begin, size_t end) {
+    fill(particles.ax.begin() + begin, particles.ax.begin() + end, 0.0f);
+    fill(particles.ay.begin() + begin, particles.ay.begin() + end, 0.0f);
+    directAccelerations(&particles.x[begin], &particles.y[begin], end - begin, particles.x.data(),
+                        particles.y.data(), particles.mass.data(), n, eps2, &particles.ax[begin],
+                        &particles.ay[begin]);
+    for (size_t i = begin; i < end; i++) {
+      particles.ax[i] *= G;
+      particles.ay[i] *= G;
+    }
+  });
+}
+
+void BarnesHutSolver::computeTree(ParticleStore &particles) {
+  const float eps2 = softening * softening;
+
+  sortByMortonCode(particles);
+  buildNode(0, 0);
+
+  // neighbouring leaves are spatial neighbours, so each chunk walks nearly the same cells
+  parallelFor(leaves.size(), 8, [&](size_t begin, size_t end) {
+    InteractionList list;
+    vector<float> ax, ay;
+
+    for (size_t l = begin; l < end; l++) {
+      const Node &leaf = nodes[leaves[l]];
+      gatherInteractions(leaf, list);
+
+      ax.assign(leaf.count, 0.0f);
+      ay.assign(leaf.count, 0.0f);
+      directAccelerations(&sx[leaf.first], &sy[leaf.first], leaf.count, list.x.data(), list.y.data(),
+                          list.mass.data(), list.x.size(), eps2, ax.data(), ay.data());
+
+      for (uint32_t k = 0; k < leaf.count; k++) {
+        particles.ax[order[leaf.first + k]] = G * ax[k];
+        particles.ay[order[leaf.first + k]] = G * ay[k];
+      }
+    }
+  });
+}
+
+void BarnesHutSolver::computeAccelerations(ParticleStore &particles) {
+  size_t n = particles.size();
+  particles.ax.resize(n);
+  particles.ay.resize(n);
+  if (n == 0)
+    return;
+
+  if (n <= directThreshold) {
+    computeDirect(particles);
+  } else {
+    computeTree(particles);
+  }
+}
+
+void BarnesHutSolver::step(ParticleStore &particles, float dt) {
+  size_t n = particles.size();
+  if (particles.ax.size() != n)
+    computeAccelerations(particles);
+
+  const float halfDt = 0.5f * dt;
+
+  parallelFor(n, 16384, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      particles.vx[i] += halfDt * particles.ax[i];
+      particles.vy[i] += halfDt * particles.ay[i];
+      particles.x[i] += dt * particles.vx[i];
+      particles.y[i] += dt * particles.vy[i];
+    }
+  });
+
+  computeAccelerations(particles);
+
+  parallelFor(n, 16384, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      particles.vx[i] += halfDt * particles.ax[i];
+      particles.vy[i] += halfDt * particles.ay[i];
+    }
+  });
+}
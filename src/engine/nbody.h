@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// structure-of-arrays particle state, index i is the same body in every array
+struct ParticleStore {
+  std::vector<float> x, y;
+  std::vector<float> vx, vy;
+  std::vector<float> ax, ay;
+  std::vector<float> mass;
+
+  size_t size() const { return x.size(); }
+  void add(float px, float py, float pvx, float pvy, float m);
+  void clear();
+};
+
+// O(N log N) gravity on a Morton-ordered quadtree, massless particles feel gravity but exert none
+class BarnesHutSolver {
+private:
+  struct Node {
+    float comX, comY, mass;
+    // bounding box of the node's particles
+    float minX, minY, maxX, maxY;
+    // the node may be used as a point mass from beyond this (squared) distance to its center of mass
+    float openRadius2;
+    // particles of the node are the range [first, first + count) in Morton order
+    uint32_t first, count;
+    uint32_t firstChild;
+    uint32_t childCount;
+  };
+
+  // far cells as point masses plus the particles of near leaves, as seen from one leaf
+  struct InteractionList {
+    std::vector<float> x, y, mass;
+    void clear();
+    void add(float px, float py, float m);
+  };
+
+  static const uint32_t maxDepth = 16;
+
+  void finishNode(Node &node) const;
+
+  std::vector<uint32_t> codes, order;
+  std::vector<uint32_t> scratchCodes, scratchOrder;
+  // positions and masses gathered into Morton order, the tree refers to these
+  std::vector<float> sx, sy, sm;
+  std::vector<Node> nodes;
+  std::vector<uint32_t> leaves;
+
+  void sortByMortonCode(const ParticleStore &particles);
+  void buildNode(uint32_t idx, uint32_t depth);
+  void gatherInteractions(const Node &group, InteractionList &list) const;
+  void computeDirect(ParticleStore &particles);
+  void computeTree(ParticleStore &particles);
+
+public:
+  // a cell is used as a single point mass when size / distance < theta, 0 degenerates to direct summation
+  float theta = 0.5f;
+  float softening = 1e-3f;
+  float G = 1.0f;
+  uint32_t leafSize = 16;
+  // at or below this many particles the exact all-pairs kernel is as fast as building a tree
+  size_t directThreshold = 2048;
+
+  void computeAccelerations(ParticleStore &particles);
+
+  // kick-drift-kick leapfrog, accelerations are carried over between steps
+  void step(ParticleStore &particles, float dt);
+
+  size_t nodeCount() const { return nodes.size(); }
+};
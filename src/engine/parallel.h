@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// splits [0, count) into chunks that idle cores pull on demand, calls f(begin, end) once per chunk
+template <typename F> void parallelFor(size_t count, size_t chunk, F &&f) {
+  size_t chunks = (count + chunk - 1) / chunk;
+  size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), chunks);
+
+  if (workers <= 1) {
+    if (count > 0)
+      f(size_t(0), count);
+    return;
+  }
+
+  std::atomic<size_t> next{0};
+  auto work = [&]() {
+    for (size_t c = next.fetch_add(1); c < chunks; c = next.fetch_add(1)) {
+      f(c * chunk, std::min(count, (c + 1) * chunk));
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < workers; t++) {
+    threads.emplace_back(work);
+  }
+  work();
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// calls f(i) for every i in [0, count). every worker starts on its own contiguous share and, once that runs
+// dry, steals the back half of another worker's remainder, so neighbouring items mostly stay on one core
+template <typename F> void workStealingFor(size_t count, F &&f) {
+  size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+
+  if (workers <= 1) {
+    for (size_t i = 0; i < count; i++)
+      f(i);
+    return;
+  }
+
+  struct Share {
+    std::mutex lock;
+    size_t begin, end;
+  };
+  std::unique_ptr<Share[]> shares(new Share[workers]);
+  for (size_t w = 0; w < workers; w++) {
+    shares[w].begin = count * w / workers;
+    shares[w].end = count * (w + 1) / workers;
+  }
+
+  auto work = [&](size_t self) {
+    for (;;) {
+      size_t item = count;
+      {
+        std::lock_guard<std::mutex> guard(shares[self].lock);
+        if (shares[self].begin < shares[self].end)
+          item = shares[self].begin++;
+      }
+
+      if (item < count) {
+        f(item);
+        continue;
+      }
+
+      // only one lock is held at a time, a stolen range is ours before anyone else can see it
+      size_t stolenBegin = 0, stolenEnd = 0;
+      for (size_t k = 1; k < workers && stolenBegin == stolenEnd; k++) {
+        Share &victim = shares[(self + k) % workers];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        size_t left = victim.end - victim.begin;
+        if (left == 0)
+          continue;
+        stolenEnd = victim.end;
+        victim.end -= (left + 1) / 2;
+        stolenBegin = victim.end;
+      }
+
+      if (stolenBegin == stolenEnd)
+        return;
+
+      std::lock_guard<std::mutex> guard(shares[self].lock);
+      shares[self].begin = stolenBegin;
+      shares[self].end = stolenEnd;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < workers; t++) {
+    threads.emplace_back(work, t);
+  }
+  work(0);
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
@@ -1,28 +1,56 @@
 #include "engine.h"
+#include <algorithm>
 #include <cstdlib>
 #include <utility>
 #include <vulkan/vulkan_core.h>
 
-RigidBody RigidBody::createSphere(float x, float y, float r, glm::vec3 color) {
-  const int increments = 10000;
-  RigidBody sphere{{}, {}};
+RigidBody RigidBody::createSphere(float x, float y, float r, glm::vec3 color, uint32_t increments) {
   std::vector<Vertex> verts;
   std::vector<uint32_t> indices;
   verts.push_back({{x, y}, color});
-  for (int i = 0; i < increments; i++) {
+  for (uint32_t i = 0; i < increments; i++) {
     float theta = (2 * PI * i) / increments;
     verts.push_back({{r * cosf(theta) + x, r * sinf(theta) + y}, color});
   }
-  for (int i = 0; i < increments; i++) {
+  for (uint32_t i = 0; i < increments; i++) {
     uint32_t last_index = i + 2;
     if (i == increments - 1) {
       last_index = 1;
     }
-    indices.insert(indices.end(), {0, (uint32_t)i + 1, last_index});
+    indices.insert(indices.end(), {0, i + 1, last_index});
   }
   return {.vertices = verts, .indices = indices};
 }
 
+// a unit circle at every power-of-two segment count in [minSegments, maxSegments], packed back to back
+RigidBody RigidBody::createCircleLods(glm::vec3 color, uint32_t minSegments, uint32_t maxSegments) {
+  RigidBody circle{};
+
+  for (uint32_t segments = minSegments; segments <= maxSegments; segments *= 2) {
+    RigidBody level = createSphere(0.0f, 0.0f, 1.0f, color, segments);
+
+    circle.lods.push_back({.segments = segments,
+                           .firstIndex = static_cast<uint32_t>(circle.indices.size()),
+                           .indexCount = static_cast<uint32_t>(level.indices.size()),
+                           .vertexOffset = static_cast<int32_t>(circle.vertices.size())});
+
+    circle.vertices.insert(circle.vertices.end(), level.vertices.begin(), level.vertices.end());
+    circle.indices.insert(circle.indices.end(), level.indices.begin(), level.indices.end());
+  }
+
+  return circle;
+}
+
+// fewest segments whose chords stay within maxErrorPixels of a circle radiusPixels wide on screen,
+// the sagitta of one segment is r * (1 - cos(pi / n))
+uint32_t RigidBody::segmentsForError(float radiusPixels, float maxErrorPixels) {
+  if (maxErrorPixels >= radiusPixels)
+    return 3;
+
+  float halfAngle = acosf(1.0f - maxErrorPixels / radiusPixels);
+  return static_cast<uint32_t>(ceilf(PI / halfAngle));
+}
+
 RigidBody RigidBody::createSquare(float x, float y, float half_length, glm::vec3 color) {
   return {
       .vertices =
@@ -38,94 +66,292 @@ RigidBody RigidBody::createSquare(float x, float y, float half_length, glm::vec3
 
 RigidBodyManager::RigidBodyManager(VulkanEngine *engine) : engine(engine) {}
 
-RigidBodyManager::~RigidBodyManager() {
-  vkDestroyBuffer(engine->device, this->vertexBuffer, nullptr);
-  vkDestroyBuffer(engine->device, this->indexBuffer, nullptr);
-  vkFreeMemory(engine->device, this->vertexMemory, nullptr);
-  vkFreeMemory(engine->device, this->indexMemory, nullptr);
+RigidBodyManager::~RigidBodyManager() { this->geometries.clear(); }
+
+// runs from VulkanEngine::cleanup, the buffers have to go back to the allocator before it is destroyed
+void RigidBodyManager::cleanup() {
+  releaseRetiredBuffers(true);
+  destroyBuffer(this->vertexBuffer, this->vertexMemory, engine->allocator);
+  destroyBuffer(this->indexBuffer, this->indexMemory, engine->allocator);
+
+  for (size_t i = 0; i < instanceBuffers.size(); i++) {
+    destroyBuffer(instanceBuffers[i], instanceMemory[i], engine->allocator);
+  }
+  instanceBuffers.clear();
+  instanceMemory.clear();
+}
+
+// FNV-1a over the raw bytes, Vertex and LodLevel have no padding
+static uint64_t hashBytes(const void *data, size_t size, uint64_t hash) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+template <typename T> static bool sameBytes(const std::vector<T> &a, const std::vector<T> &b) {
+  return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+SlotHandle RigidBodyManager::addGeometry(RigidBody body, const std::string &name) {
+  // a color shared by every vertex moves to the geometry, the same shape in another color reuses the mesh
+  if (!body.vertices.empty()) {
+    glm::vec3 shared = body.vertices.front().color;
+    if (std::all_of(body.vertices.begin(), body.vertices.end(),
+                    [&](const Vertex &vertex) { return vertex.color == shared; })) {
+      body.color = body.color * shared;
+      for (Vertex &vertex : body.vertices)
+        vertex.color = glm::vec3(1.0f);
+    }
+  }
+
+  uint64_t hash = 0xcbf29ce484222325ull;
+  hash = hashBytes(body.vertices.data(), body.vertices.size() * sizeof(Vertex), hash);
+  hash = hashBytes(body.indices.data(), body.indices.size() * sizeof(uint32_t), hash);
+  hash = hashBytes(body.lods.data(), body.lods.size() * sizeof(LodLevel), hash);
+
+  // a matching hash is only a candidate, the content decides
+  body.mesh = UINT32_MAX;
+  auto [first, last] = meshesByHash.equal_range(hash);
+  for (auto it = first; it != last; it++) {
+    const Mesh &mesh = meshes[it->second];
+    if (sameBytes(mesh.vertices, body.vertices) && sameBytes(mesh.indices, body.indices) &&
+        sameBytes(mesh.lods, body.lods)) {
+      body.mesh = it->second;
+      break;
+    }
+  }
+
+  if (body.mesh == UINT32_MAX) {
+    // indices are relative to the mesh, the draws add its vertex offset
+    uint32_t maxIndex = 0;
+    for (uint32_t index : body.indices)
+      maxIndex = std::max(maxIndex, index);
+
+    body.mesh = static_cast<uint32_t>(meshes.size());
+    meshesByHash.insert({hash, body.mesh});
+    meshes.push_back({.vertices = std::move(body.vertices),
+                      .indices = std::move(body.indices),
+                      .lods = std::move(body.lods),
+                      .hash = hash,
+                      .indexType = maxIndex <= UINT16_MAX ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32});
+  }
+
+  // the shared mesh holds the only copy
+  body.vertices = {};
+  body.indices = {};
+  body.lods = {};
+
+  markSceneDirty();
+
+  auto named = name.empty() ? geometryNames.end() : geometryNames.find(name);
+  if (named != geometryNames.end() && geometries.contains(named->second)) {
+    geometries.at(named->second) = std::move(body);
+    return named->second;
+  }
+
+  SlotHandle handle = geometries.insert(std::move(body));
+  if (!name.empty()) {
+    geometryNames[name] = handle;
+    if (slotNames.size() <= handle.index)
+      slotNames.resize(handle.index + 1);
+    slotNames[handle.index] = name;
+  }
+  return handle;
+}
+
+void RigidBodyManager::removeGeometry(SlotHandle handle) {
+  if (!geometries.erase(handle))
+    return;
+
+  if (handle.index < slotNames.size() && !slotNames[handle.index].empty()) {
+    geometryNames.erase(slotNames[handle.index]);
+    slotNames[handle.index].clear();
+  }
+  markSceneDirty();
+}
 
-  this->geometries.clear();
+SlotHandle RigidBodyManager::findGeometry(const std::string &name) const {
+  auto named = geometryNames.find(name);
+  return named == geometryNames.end() ? SlotHandle{} : named->second;
 }
 
+// meshes go back to back, the 16-bit index meshes ahead of the 32-bit ones. instances follow the geometries
 void RigidBodyManager::calculateOffsets() {
+  VkDeviceSize idxOffset = 0, vertexOffset = 0, instanceOffset = 0;
+
+  for (Mesh &mesh : this->meshes) {
+    mesh.vertexOffset = vertexOffset;
+    vertexOffset += mesh.getVertSize(vertexLayout);
+  }
+
+  for (VkIndexType type : {VK_INDEX_TYPE_UINT16, VK_INDEX_TYPE_UINT32}) {
+    // the 32-bit section is bound at its own offset, which has to be a multiple of 4
+    if (type == VK_INDEX_TYPE_UINT32) {
+      idxOffset = (idxOffset + 3) / 4 * 4;
+      index32Offset = idxOffset;
+    }
+    for (Mesh &mesh : this->meshes) {
+      if (mesh.indexType != type)
+        continue;
+      mesh.indexOffset = idxOffset;
+      idxOffset += mesh.getIndexSize();
+    }
+  }
 
-  VkDeviceSize idxOffset, vertexOffset;
-  idxOffset = 0;
-  vertexOffset = 0;
+  for (RigidBody &rb : this->geometries) {
+    rb.vertexOffset = meshes[rb.mesh].vertexOffset;
+    rb.indexOffset = meshes[rb.mesh].indexOffset;
+    rb.indexType = meshes[rb.mesh].indexType;
+    rb.instanceOffset = instanceOffset;
 
-  for (auto &[name, rb] : this->geometries) {
-    rb.vertexOffset = vertexOffset;
-    rb.indexOffset = idxOffset;
+    instanceOffset += rb.getInstanceSize();
+  }
+}
 
-    vertexOffset += rb.getVertSize();
-    idxOffset += rb.getIndexSize();
+std::tuple<VkDeviceSize, VkDeviceSize, VkDeviceSize> RigidBodyManager::getSizes() {
+  VkDeviceSize idxSz = 0, vertSz = 0, instanceSz = 0;
+  for (const Mesh &mesh : this->meshes) {
+    vertSz += mesh.getVertSize(vertexLayout);
+    // the end of the last mesh in either section, padding included
+    if (mesh.indexOffset + mesh.getIndexSize() > idxSz)
+      idxSz = mesh.indexOffset + mesh.getIndexSize();
+  }
+  for (RigidBody &rb : this->geometries) {
+    instanceSz += rb.getInstanceSize();
   }
+  return std::make_tuple(idxSz, vertSz, instanceSz);
 }
 
-std::pair<VkDeviceSize, VkDeviceSize> RigidBodyManager::getSizes() {
-  VkDeviceSize idxSz = 0, vertSz = 0;
-  for (auto &[name, rb] : this->geometries) {
-    vertSz += rb.getVertSize();
-    idxSz += rb.getIndexSize();
+// pack the meshes back to back, the offsets match the ones the draws use. calculateOffsets must have run
+// and the arrays must hold getSizes() bytes
+void RigidBodyManager::packMeshes(std::vector<uint8_t> &vertexData, std::vector<uint8_t> &indexData) {
+  for (const Mesh &mesh : this->meshes) {
+    Vertex::pack(vertexLayout, mesh.vertices.data(), mesh.vertices.size(),
+                 vertexData.data() + mesh.vertexOffset);
+
+    if (mesh.indexType == VK_INDEX_TYPE_UINT32) {
+      std::memcpy(indexData.data() + mesh.indexOffset, mesh.indices.data(), (size_t)mesh.getIndexSize());
+      continue;
+    }
+    uint16_t *narrow = reinterpret_cast<uint16_t *>(indexData.data() + mesh.indexOffset);
+    for (size_t i = 0; i < mesh.indices.size(); i++) {
+      narrow[i] = static_cast<uint16_t>(mesh.indices[i]);
+    }
   }
-  return std::make_pair(idxSz, vertSz);
 }
 
 void RigidBodyManager::loadToGpu() {
+  ProfileScope scope(engine->profiler, "loadToGpu");
   this->calculateOffsets();
+  uploadMeshes();
+
+  // per-frame instance copies, filled by syncInstances before each frame records and read by the cull pass
+  size_t frames = engine->max_inflight_frames;
+  instanceBuffers.resize(frames);
+  instanceMemory.resize(frames);
+  for (uint32_t i = 0; i < frames; i++) {
+    createInstanceBuffer(i);
+  }
+
+  // new buffers, the recorded draws point at the old ones
+  markSceneDirty();
+  layoutVersion = sceneVersion;
+  instanceLayouts.assign(frames, sceneVersion);
+  instanceVersions.assign(frames, instanceVersion - 1);
+}
+
+// packs every mesh into fresh vertex and index buffers, calculateOffsets must have run
+void RigidBodyManager::uploadMeshes() {
   auto sizes = this->getSizes();
   VkDeviceSize vertexBufferSz = std::get<1>(sizes);
   VkDeviceSize indicesBufferSz = std::get<0>(sizes);
 
-  std::cout << "sizes: " << vertexBufferSz << " " << indicesBufferSz << std::endl;
+  std::vector<uint8_t> vertexData(vertexBufferSz), indexData(indicesBufferSz);
+  packMeshes(vertexData, indexData);
 
-  // copy from our structs into staging buffer
-  VkBuffer vertexStagingBuffer, indicesStagingBuffer;
-  VkDeviceMemory vertexStagingBufferMemory, indicesStagingBufferMemory;
+  // create our GPU-only buffers
+  createBuffer(vertexBufferSz, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexMemory, engine->allocator);
 
-  createBuffer(vertexBufferSz, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               vertexStagingBuffer, vertexStagingBufferMemory, 0, &engine->device, &engine->physicalDevice);
+  createBuffer(indicesBufferSz, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexMemory, engine->allocator);
+
+  // only ever read on the graphics queue after the batch's barrier, no need to wait here
+  engine->staging.uploadBuffer(vertexData.data(), vertexBufferSz, vertexBuffer);
+  engine->staging.uploadBuffer(indexData.data(), indicesBufferSz, indexBuffer);
+  engine->staging.submit();
 
-  createBuffer(indicesBufferSz, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+  uploadedMeshes = meshes.size();
+}
+
+void RigidBodyManager::createInstanceBuffer(uint32_t frame) {
+  // never empty, every geometry may have been removed
+  VkDeviceSize instanceBufferSz = std::max<VkDeviceSize>(std::get<2>(getSizes()), sizeof(Instance));
+  createBuffer(instanceBufferSz, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               indicesStagingBuffer, indicesStagingBufferMemory, 0, &engine->device, &engine->physicalDevice);
+               instanceBuffers[frame], instanceMemory[frame], engine->allocator);
+}
 
-  void *vertexData = nullptr, *indexData = nullptr;
+// frame k's fence is waited at the start of frame k + max_inflight_frames, the same rule the retired
+// swapchains follow
+void RigidBodyManager::releaseRetiredBuffers(bool all) {
+  while (!retiredBuffers.empty()) {
+    RetiredBuffer &retired = retiredBuffers.front();
+    if (!all && retired.retiredAt + engine->max_inflight_frames > engine->submittedFrames + 1)
+      return;
 
-  vkMapMemory(engine->device, vertexStagingBufferMemory, 0, vertexBufferSz, 0, &vertexData);
-  vkMapMemory(engine->device, indicesStagingBufferMemory, 0, indicesBufferSz, 0, &indexData);
+    destroyBuffer(retired.buffer, retired.memory, engine->allocator);
+    retiredBuffers.pop_front();
+  }
+}
+
+// only called once the frame's fence has signalled, so the GPU is done reading this copy. the shared
+// vertex and index buffers may still be read by the other frames in flight, a re-upload retires them
+void RigidBodyManager::syncInstances(uint32_t frame) {
+  releaseRetiredBuffers(false);
 
-  for (const auto &[name, rb] : this->geometries) {
-    void *v_ptr = static_cast<void *>(((char *)vertexData) + rb.vertexOffset);
-    void *i_ptr = static_cast<void *>(((char *)indexData) + rb.indexOffset);
-    std::memcpy(v_ptr, rb.vertices.data(), (size_t)rb.vertices.size() * sizeof(rb.vertices[0]));
-    std::memcpy(i_ptr, rb.indices.data(), (size_t)rb.indices.size() * sizeof(rb.indices[0]));
+  if (layoutVersion != sceneVersion) {
+    ProfileScope scope(engine->profiler, "relayout");
+    this->calculateOffsets();
+    // meshes are only ever added, removing a geometry leaves the packed ones where they are
+    if (uploadedMeshes != meshes.size()) {
+      uint64_t submitted = engine->submittedFrames;
+      retiredBuffers.push_back({.buffer = vertexBuffer, .memory = vertexMemory, .retiredAt = submitted});
+      retiredBuffers.push_back({.buffer = indexBuffer, .memory = indexMemory, .retiredAt = submitted});
+      uploadMeshes();
+    }
+    layoutVersion = sceneVersion;
   }
 
-  vkUnmapMemory(engine->device, vertexStagingBufferMemory);
-  vkUnmapMemory(engine->device, indicesStagingBufferMemory);
-  vertexData = nullptr;
-  indexData = nullptr;
+  // the instance counts changed, this slot's copy is resized and rewritten in full
+  if (instanceLayouts[frame] != layoutVersion) {
+    destroyBuffer(instanceBuffers[frame], instanceMemory[frame], engine->allocator);
+    createInstanceBuffer(frame);
+    instanceLayouts[frame] = layoutVersion;
+    instanceVersions[frame] = instanceVersion - 1;
+  }
 
-  // create our GPU-only buffers, begin transfer
-  createBuffer(vertexBufferSz, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexMemory, 0, &engine->device,
-               &engine->physicalDevice);
+  if (instanceVersions[frame] == instanceVersion)
+    return;
 
-  createBuffer(indicesBufferSz, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexMemory, 0, &engine->device,
-               &engine->physicalDevice);
-
-  engine->beginTransfers();
-  engine->copyBuffer(vertexStagingBuffer, vertexBuffer, vertexBufferSz);
-  engine->copyBuffer(indicesStagingBuffer, indexBuffer, indicesBufferSz);
-  engine->endTransfers();
-  engine->waitForTransfers();
-
-  // clean staging buffers
-  vkDestroyBuffer(engine->device, vertexStagingBuffer, nullptr);
-  vkDestroyBuffer(engine->device, indicesStagingBuffer, nullptr);
-  vkFreeMemory(engine->device, vertexStagingBufferMemory, nullptr);
-  vkFreeMemory(engine->device, indicesStagingBufferMemory, nullptr);
+  for (const RigidBody &rb : this->geometries) {
+    void *n_ptr = static_cast<void *>(((char *)instanceMemory[frame].mapped) + rb.instanceOffset);
+    std::memcpy(n_ptr, rb.instances.data(), (size_t)rb.instances.size() * sizeof(Instance));
+    syncedBytes += rb.getInstanceSize();
+  }
+
+  instanceVersions[frame] = instanceVersion;
+}
+
+void VulkanEngine::stepSimulation() {
+  solver.step(particles, simulationDt);
+
+  auto &instances = rigidBodyManager.geometries.at(circleGeometry).instances;
+  for (size_t i = 0; i < particles.size(); i++) {
+    instances[i].center = {particles.x[i], particles.y[i]};
+  }
+
+  rigidBodyManager.markInstancesDirty();
 }
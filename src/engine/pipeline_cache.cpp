@@ -0,0 +1,111 @@
+#include "engine.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+using namespace std;
+
+// validates the VkPipelineCacheHeaderVersionOne at the front of a saved cache, drivers reject foreign data
+// anyway but some of them only after a slow parse
+static string checkHeader(const vector<char> &data, const VkPhysicalDeviceProperties &properties) {
+  VkPipelineCacheHeaderVersionOne header;
+  if (data.size() < sizeof(header))
+    return "truncated";
+  memcpy(&header, data.data(), sizeof(header));
+
+  if (header.headerSize < sizeof(header) || header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
+    return "unknown header";
+  if (header.vendorID != properties.vendorID || header.deviceID != properties.deviceID)
+    return "different device";
+  if (memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+    return "different driver";
+  return "";
+}
+
+void PipelineCache::create(VkDevice device, VkPhysicalDevice physicalDevice, const string &path) {
+  this->device = device;
+  this->path = path;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+  vector<char> data;
+  ifstream file(path, ios::binary | ios::ate);
+  if (file.is_open()) {
+    data.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(data.data(), data.size());
+    missReason = checkHeader(data, properties);
+  } else {
+    missReason = "no cache file";
+  }
+  if (!missReason.empty())
+    data.clear();
+
+  VkPipelineCacheCreateInfo cacheInfo{
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+      .initialDataSize = data.size(),
+      .pInitialData = data.empty() ? nullptr : data.data(),
+  };
+
+  if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache) != VK_SUCCESS) {
+    // the header matched but the driver still refused the contents, start over empty
+    missReason = "rejected by the driver";
+    cacheInfo.initialDataSize = 0;
+    cacheInfo.pInitialData = nullptr;
+    if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache) != VK_SUCCESS) {
+      throw runtime_error("failed to create pipeline cache!");
+    }
+  }
+  loadedSize = missReason.empty() ? data.size() : 0;
+}
+
+void PipelineCache::save() {
+  size_t size = 0;
+  vkGetPipelineCacheData(device, cache, &size, nullptr);
+
+  // a hit that compiled nothing new leaves the file as it is, most short runs end here
+  if (size == loadedSize)
+    return;
+
+  vector<char> data(size);
+  if (vkGetPipelineCacheData(device, cache, &size, data.data()) != VK_SUCCESS) {
+    cerr << "pipeline cache: could not read back the cache data" << endl;
+    return;
+  }
+  data.resize(size);
+
+  // a name of our own, other jobs may be saving the same cache right now
+  string temporary = path + ".tmp" + to_string(random_device{}());
+  {
+    ofstream file(temporary, ios::binary | ios::trunc);
+    file.write(data.data(), data.size());
+    if (!file) {
+      cerr << "pipeline cache: could not write " << temporary << endl;
+      file.close();
+      remove(temporary.c_str());
+      return;
+    }
+  }
+
+  // rename replaces the old file in one step
+  error_code error;
+  filesystem::rename(temporary, path, error);
+  if (error) {
+    cerr << "pipeline cache: could not replace " << path << ": " << error.message() << endl;
+    remove(temporary.c_str());
+  }
+}
+
+void PipelineCache::destroy() { vkDestroyPipelineCache(device, cache, nullptr); }
+
+void PipelineCache::recordCompile(chrono::steady_clock::time_point start) {
+  compileSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  pipelines++;
+}
+
+void PipelineCache::report() const {
+  cout << "pipeline cache: " << (missReason.empty() ? "hit" : "miss (" + missReason + ")") << ", "
+       << pipelines << " pipelines in " << compileSeconds * 1e3 << " ms" << endl;
+}
@@ -0,0 +1,173 @@
+#include "profiler.h"
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+// small stable ids for the trace, 0 is the GPU track
+static uint32_t currentThread() {
+  static atomic<uint32_t> next{Profiler::gpuThread + 1};
+  thread_local uint32_t id = next++;
+  return id;
+}
+
+void Profiler::create(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t queueFamily, uint32_t frames,
+                      bool enabled) {
+  this->device = device;
+  this->enabled = enabled;
+  origin = chrono::steady_clock::now();
+  if (!enabled)
+    return;
+
+  events.reserve(64 * 1024);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+  uint32_t familyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+  vector<VkQueueFamilyProperties> families(familyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+
+  uint32_t validBits = families[queueFamily].timestampValidBits;
+  if (validBits == 0) {
+    cerr << "profiler: the queue writes no timestamps, GPU scopes are off" << endl;
+    return;
+  }
+  timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+  timestampPeriod = properties.limits.timestampPeriod;
+
+  VkQueryPoolCreateInfo poolInfo{
+      .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      .queryType = VK_QUERY_TYPE_TIMESTAMP,
+      .queryCount = firstQuery(frames),
+  };
+
+  if (vkCreateQueryPool(device, &poolInfo, nullptr, &queryPool) != VK_SUCCESS) {
+    throw runtime_error("failed to create timestamp query pool!");
+  }
+  gpuFrames.resize(frames);
+}
+
+void Profiler::destroy() {
+  if (queryPool != VK_NULL_HANDLE)
+    vkDestroyQueryPool(device, queryPool, nullptr);
+  queryPool = VK_NULL_HANDLE;
+}
+
+double Profiler::now() const {
+  return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count();
+}
+
+void Profiler::record(const char *name, double start, double end) {
+  uint32_t thread = currentThread();
+  lock_guard<mutex> guard(lock);
+  events.push_back(
+      {.name = name, .category = "cpu", .start = start, .duration = end - start, .thread = thread});
+}
+
+void Profiler::beginGpuFrame(VkCommandBuffer commandBuffer, uint32_t slot) {
+  if (!enabled || queryPool == VK_NULL_HANDLE)
+    return;
+
+  // the slot's last results were collected after its fence, the queries are free to reuse
+  vkCmdResetQueryPool(commandBuffer, queryPool, firstQuery(slot), 2 * maxGpuScopes);
+  gpuFrames[slot].names.clear();
+  gpuFrames[slot].open.clear();
+}
+
+void Profiler::beginGpuScope(VkCommandBuffer commandBuffer, uint32_t slot, const char *name) {
+  if (queryPool == VK_NULL_HANDLE)
+    return;
+
+  GpuFrame &frame = gpuFrames[slot];
+  if (frame.names.size() == maxGpuScopes) {
+    frame.open.push_back(UINT32_MAX);
+    return;
+  }
+
+  uint32_t scope = static_cast<uint32_t>(frame.names.size());
+  frame.names.push_back(name);
+  frame.open.push_back(scope);
+  vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool,
+                      firstQuery(slot) + 2 * scope);
+}
+
+void Profiler::endGpuScope(VkCommandBuffer commandBuffer, uint32_t slot) {
+  if (queryPool == VK_NULL_HANDLE)
+    return;
+
+  GpuFrame &frame = gpuFrames[slot];
+  uint32_t scope = frame.open.back();
+  frame.open.pop_back();
+  if (scope == UINT32_MAX)
+    return;
+
+  vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool,
+                      firstQuery(slot) + 2 * scope + 1);
+}
+
+void Profiler::markSubmitted(uint32_t slot) {
+  if (!enabled || queryPool == VK_NULL_HANDLE)
+    return;
+
+  gpuFrames[slot].submitted = now();
+  gpuFrames[slot].pending = !gpuFrames[slot].names.empty();
+}
+
+void Profiler::collect(uint32_t slot) {
+  if (!enabled || queryPool == VK_NULL_HANDLE || !gpuFrames[slot].pending)
+    return;
+
+  GpuFrame &frame = gpuFrames[slot];
+  frame.pending = false;
+
+  // no WAIT flag, the fence already covers the frame. a driver that still says not ready loses the frame
+  vector<uint64_t> ticks(2 * frame.names.size());
+  if (vkGetQueryPoolResults(device, queryPool, firstQuery(slot), static_cast<uint32_t>(ticks.size()),
+                            ticks.size() * sizeof(uint64_t), ticks.data(), sizeof(uint64_t),
+                            VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+    return;
+
+  // GPU and CPU clocks are unrelated without calibrated timestamps, the frame is shifted to its submit
+  double microsPerTick = timestampPeriod / 1000.0;
+  uint64_t base = ticks[0] & timestampMask;
+
+  lock_guard<mutex> guard(lock);
+  for (size_t i = 0; i < frame.names.size(); i++) {
+    uint64_t begin = (ticks[2 * i] - base) & timestampMask;
+    uint64_t end = (ticks[2 * i + 1] - base) & timestampMask;
+    events.push_back({.name = frame.names[i],
+                      .category = "gpu",
+                      .start = frame.submitted + begin * microsPerTick,
+                      .duration = (end - begin) * microsPerTick,
+                      .thread = gpuThread});
+  }
+}
+
+void Profiler::write(const string &path) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file) {
+    cerr << "profiler: could not write " << path << endl;
+    return;
+  }
+
+  lock_guard<mutex> guard(lock);
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(file,
+          "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %u, "
+          "\"args\": {\"name\": \"GPU\"}}",
+          gpuThread);
+  for (const Event &event : events) {
+    fprintf(file,
+            ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, "
+            "\"tid\": %u}",
+            event.name, event.category, event.start, event.duration, event.thread);
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+
+  cout << "profiler: " << events.size() << " events written to " << path << endl;
+}
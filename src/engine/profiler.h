@@ -0,0 +1,115 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// CPU scopes and GPU timestamp pairs, written out as a Chrome trace (chrome://tracing or ui.perfetto.dev).
+// while disabled every entry point is a single branch and nothing is allocated
+class Profiler {
+private:
+  struct Event {
+    // string literals, the trace is written long after the scope ends
+    const char *name;
+    const char *category;
+    // microseconds since create()
+    double start, duration;
+    uint32_t thread;
+  };
+
+  // the timestamp pairs recorded into one frame slot's range of the query pool
+  struct GpuFrame {
+    std::vector<const char *> names;
+    // scopes begun but not ended yet, innermost last
+    std::vector<uint32_t> open;
+    // CPU time of the submit, the frame's GPU scopes are lined up to start there
+    double submitted = 0.0;
+    bool pending = false;
+  };
+
+  bool enabled = false;
+  std::chrono::steady_clock::time_point origin;
+  std::mutex lock;
+  std::vector<Event> events;
+
+  VkDevice device = VK_NULL_HANDLE;
+  VkQueryPool queryPool = VK_NULL_HANDLE;
+  // nanoseconds per tick, and the bits of a timestamp the queue actually writes
+  float timestampPeriod = 0.0f;
+  uint64_t timestampMask = 0;
+  std::vector<GpuFrame> gpuFrames;
+
+  uint32_t firstQuery(uint32_t slot) const { return 2 * maxGpuScopes * slot; }
+
+public:
+  // GPU scopes per frame, later ones are dropped
+  static constexpr uint32_t maxGpuScopes = 16;
+  // the trace shows GPU work as its own thread
+  static constexpr uint32_t gpuThread = 0;
+
+  // GPU scopes need a queue family with timestampValidBits, they are skipped on one without
+  void create(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t queueFamily, uint32_t frames,
+              bool enabled);
+  void destroy();
+  bool isEnabled() const { return enabled; }
+
+  // microseconds since create()
+  double now() const;
+  void record(const char *name, double start, double end);
+
+  // all recorded into the frame's primary command buffer, beginGpuFrame before any scope and outside a
+  // render pass
+  void beginGpuFrame(VkCommandBuffer commandBuffer, uint32_t slot);
+  void beginGpuScope(VkCommandBuffer commandBuffer, uint32_t slot, const char *name);
+  void endGpuScope(VkCommandBuffer commandBuffer, uint32_t slot);
+  void markSubmitted(uint32_t slot);
+  // reads the slot's previous frame back, only call once that frame's fence has signalled so it never waits
+  void collect(uint32_t slot);
+
+  // every event so far as Chrome trace JSON
+  void write(const std::string &path);
+};
+
+// times its own lifetime on the calling thread
+class ProfileScope {
+private:
+  Profiler *profiler;
+  const char *name;
+  double start = 0.0;
+
+public:
+  ProfileScope(Profiler &profiler, const char *name)
+      : profiler(profiler.isEnabled() ? &profiler : nullptr), name(name) {
+    if (this->profiler)
+      start = profiler.now();
+  }
+  ~ProfileScope() {
+    if (profiler)
+      profiler->record(name, start, profiler->now());
+  }
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+};
+
+// brackets the commands recorded during its lifetime with a pair of timestamps
+class GpuProfileScope {
+private:
+  Profiler *profiler;
+  VkCommandBuffer commandBuffer;
+  uint32_t slot;
+
+public:
+  GpuProfileScope(Profiler &profiler, VkCommandBuffer commandBuffer, uint32_t slot, const char *name)
+      : profiler(profiler.isEnabled() ? &profiler : nullptr), commandBuffer(commandBuffer), slot(slot) {
+    if (this->profiler)
+      profiler.beginGpuScope(commandBuffer, slot, name);
+  }
+  ~GpuProfileScope() {
+    if (profiler)
+      profiler->endGpuScope(commandBuffer, slot);
+  }
+  GpuProfileScope(const GpuProfileScope &) = delete;
+  GpuProfileScope &operator=(const GpuProfileScope &) = delete;
+};
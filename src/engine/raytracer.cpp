@@ -0,0 +1,198 @@
+#include "raytracer.h"
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+static float fract(float x) { return x - floorf(x); }
+
+// matches hash() in lensing.frag
+static float starHash(float x, float y, float z) {
+  x = fract(x * 443.897f);
+  y = fract(y * 441.423f);
+  z = fract(z * 437.195f);
+  float d = x * (y + 19.19f) + y * (z + 19.19f) + z * (x + 19.19f);
+  x += d;
+  y += d;
+  z += d;
+  return fract((x + y) * z);
+}
+
+// matches starfield() in lensing.frag
+static void starfield(float dx, float dy, float dz, float rgb[3]) {
+  const float density = 120.0f;
+  float px = dx * density, py = dy * density, pz = dz * density;
+  float cx = floorf(px), cy = floorf(py), cz = floorf(pz);
+
+  rgb[0] = rgb[1] = rgb[2] = 0.0f;
+  float brightness = starHash(cx, cy, cz);
+  if (brightness < 0.97f)
+    return;
+
+  float sx = cx + starHash(cx + 1.7f, cy + 1.7f, cz + 1.7f) - px;
+  float sy = cy + starHash(cx + 3.1f, cy + 3.1f, cz + 3.1f) - py;
+  float sz = cz + starHash(cx + 5.3f, cy + 5.3f, cz + 5.3f) - pz;
+  float intensity = expf(-40.0f * (sx * sx + sy * sy + sz * sz)) * (brightness - 0.97f) / 0.03f;
+
+  float t = starHash(cx + 7.9f, cy + 7.9f, cz + 7.9f);
+  rgb[0] = (1.0f + t * (0.6f - 1.0f)) * intensity;
+  rgb[1] = 0.8f * intensity;
+  rgb[2] = (0.6f + t * (1.0f - 0.6f)) * intensity;
+}
+
+static uint8_t encodeSrgb(float linear) {
+  linear = clamp(linear, 0.0f, 1.0f);
+  float encoded = linear <= 0.0031308f ? 12.92f * linear : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+  return static_cast<uint8_t>(encoded * 255.0f + 0.5f);
+}
+
+GeodesicTracer::GeodesicTracer(const TraceSettings &settings, vector<TraceDisc> discs)
+    : settings(settings), discs(std::move(discs)) {
+  buildGrid();
+}
+
+void GeodesicTracer::buildGrid() {
+  auto cellRange = [](float lo, float hi, uint32_t &first, uint32_t &last) {
+    auto toCell = [](float v) {
+      return static_cast<uint32_t>(clamp((v + 1.0f) * 0.5f * gridSize, 0.0f, gridSize - 1.0f));
+    };
+    first = toCell(lo);
+    last = toCell(hi);
+  };
+
+  // counting sort of (cell, disc) pairs, discs stay in draw order inside each cell
+  cellStart.assign(gridSize * gridSize + 1, 0);
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      for (size_t c = 1; c < cellStart.size(); c++)
+        cellStart[c] += cellStart[c - 1];
+      cellDiscs.resize(cellStart.back());
+    }
+
+    vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+    for (uint32_t d = 0; d < discs.size(); d++) {
+      const TraceDisc &disc = discs[d];
+      float zoomed = disc.radius * settings.zoom;
+      float cx = disc.x * settings.zoom, cy = disc.y * settings.zoom;
+      if (cx + zoomed < -1.0f || cx - zoomed > 1.0f || cy + zoomed < -1.0f || cy - zoomed > 1.0f)
+        continue;
+
+      uint32_t x0, x1, y0, y1;
+      cellRange(cx - zoomed, cx + zoomed, x0, x1);
+      cellRange(cy - zoomed, cy + zoomed, y0, y1);
+      for (uint32_t y = y0; y <= y1; y++) {
+        for (uint32_t x = x0; x <= x1; x++) {
+          if (pass == 0)
+            cellStart[y * gridSize + x + 1]++;
+          else
+            cellDiscs[fill[y * gridSize + x]++] = d;
+        }
+      }
+    }
+  }
+}
+
+void GeodesicTracer::shade(float bent, float radialX, float radialY, bool captured, float rgb[3]) const {
+  rgb[0] = rgb[1] = rgb[2] = 0.0f;
+  if (captured)
+    return;
+
+  float s = sinf(bent), c = cosf(bent);
+  starfield(s * radialX, s * radialY, c, rgb);
+
+  // the scene is a backdrop far behind the hole seen through the same camera, as in lensing.frag
+  if (c <= 0.0f)
+    return;
+
+  float tanHalfFov = tanf(0.5f * settings.camera.fieldOfView);
+  float aspect = static_cast<float>(settings.width) / settings.height;
+  float x = tanf(bent) * radialX / (aspect * tanHalfFov), y = tanf(bent) * radialY / tanHalfFov;
+  if (fabsf(x) > 1.0f || fabsf(y) > 1.0f)
+    return;
+
+  uint32_t cx = min(static_cast<uint32_t>((x + 1.0f) * 0.5f * gridSize), gridSize - 1);
+  uint32_t cy = min(static_cast<uint32_t>((y + 1.0f) * 0.5f * gridSize), gridSize - 1);
+  uint32_t cell = cy * gridSize + cx;
+
+  // later instances are drawn over earlier ones
+  for (uint32_t k = cellStart[cell + 1]; k > cellStart[cell]; k--) {
+    const TraceDisc &disc = discs[cellDiscs[k - 1]];
+    float dx = x - disc.x * settings.zoom, dy = y - disc.y * settings.zoom;
+    float radius = disc.radius * settings.zoom;
+    if (dx * dx + dy * dy <= radius * radius) {
+      rgb[0] = disc.r;
+      rgb[1] = disc.g;
+      rgb[2] = disc.b;
+      return;
+    }
+  }
+}
+
+uint64_t GeodesicTracer::traceTile(uint32_t tile, uint8_t *pixels) const {
+  const uint32_t tilesX = (settings.width + settings.tileSize - 1) / settings.tileSize;
+  const uint32_t x0 = (tile % tilesX) * settings.tileSize, y0 = (tile / tilesX) * settings.tileSize;
+  const uint32_t x1 = min(x0 + settings.tileSize, settings.width);
+  const uint32_t y1 = min(y0 + settings.tileSize, settings.height);
+
+  const double r = settings.camera.observerDistance;
+  const float tanHalfFov = tanf(0.5f * settings.camera.fieldOfView);
+  const float aspect = static_cast<float>(settings.width) / settings.height;
+
+  // the whole tile is integrated as one batch
+  const size_t count = static_cast<size_t>(x1 - x0) * (y1 - y0);
+  vector<double> impact(count);
+  vector<float> alpha(count), radialX(count), radialY(count);
+  vector<RayDeflection> rays(count);
+
+  for (uint32_t y = y0; y < y1; y++) {
+    for (uint32_t x = x0; x < x1; x++) {
+      size_t i = static_cast<size_t>(y - y0) * (x1 - x0) + (x - x0);
+      float ndcX = (x + 0.5f) / settings.width * 2.0f - 1.0f;
+      float ndcY = (y + 0.5f) / settings.height * 2.0f - 1.0f;
+      float tx = ndcX * aspect * tanHalfFov, ty = ndcY * tanHalfFov;
+      float t = hypotf(tx, ty);
+
+      alpha[i] = atanf(t);
+      radialX[i] = t > 0.0f ? tx / t : 1.0f;
+      radialY[i] = t > 0.0f ? ty / t : 0.0f;
+      impact[i] = r * sin(static_cast<double>(alpha[i])) / sqrt(1.0 - 2.0 / r);
+    }
+  }
+
+  uint64_t steps = traceRays(impact.data(), count, r, rays.data(), settings.integrator);
+
+  for (uint32_t y = y0; y < y1; y++) {
+    for (uint32_t x = x0; x < x1; x++) {
+      size_t i = static_cast<size_t>(y - y0) * (x1 - x0) + (x - x0);
+      float rgb[3];
+      shade(alpha[i] - rays[i].deflection, radialX[i], radialY[i], rays[i].captured, rgb);
+
+      uint8_t *pixel = pixels + 4 * (static_cast<size_t>(y) * settings.width + x);
+      pixel[0] = encodeSrgb(rgb[2]);
+      pixel[1] = encodeSrgb(rgb[1]);
+      pixel[2] = encodeSrgb(rgb[0]);
+      pixel[3] = 255;
+    }
+  }
+  return steps;
+}
+
+TraceStats GeodesicTracer::render(uint8_t *pixels) const {
+  auto start = chrono::steady_clock::now();
+
+  uint32_t tilesX = (settings.width + settings.tileSize - 1) / settings.tileSize;
+  uint32_t tilesY = (settings.height + settings.tileSize - 1) / settings.tileSize;
+
+  atomic<uint64_t> steps{0};
+  workStealingFor(static_cast<size_t>(tilesX) * tilesY, [&](size_t tile) {
+    steps += traceTile(static_cast<uint32_t>(tile), pixels);
+  });
+
+  return {.rays = static_cast<uint64_t>(settings.width) * settings.height,
+          .steps = steps.load(),
+          .seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count(),
+          .threads = min<size_t>(max(1u, thread::hardware_concurrency()), tilesX * tilesY)};
+}
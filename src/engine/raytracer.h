@@ -0,0 +1,48 @@
+#pragma once
+#include "geodesic.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// a body of the unlensed scene, in the same NDC units the vertex shader draws instances in
+struct TraceDisc {
+  float x, y, radius;
+  float r, g, b;
+};
+
+struct TraceSettings {
+  uint32_t width = 800, height = 800;
+  LensCamera camera;
+  float zoom = 1.0f;
+  uint32_t tileSize = 16;
+  IntegratorSettings integrator;
+};
+
+struct TraceStats {
+  uint64_t rays = 0;
+  uint64_t steps = 0;
+  double seconds = 0.0;
+  size_t threads = 0;
+};
+
+// CPU reference for the lensing pass, integrates the geodesic of every pixel instead of reading the table.
+// writes BGRA8 with sRGB encoding, the same layout the engine reads back from its B8G8R8A8_SRGB targets
+class GeodesicTracer {
+private:
+  TraceSettings settings;
+
+  // the discs are bucketed on a grid over [-1, 1]^2 so a lookup only tests the few that can cover a point
+  static const uint32_t gridSize = 64;
+  std::vector<TraceDisc> discs;
+  std::vector<uint32_t> cellStart, cellDiscs;
+
+  void buildGrid();
+  void shade(float bent, float radialX, float radialY, bool captured, float rgb[3]) const;
+  uint64_t traceTile(uint32_t tile, uint8_t *pixels) const;
+
+public:
+  GeodesicTracer(const TraceSettings &settings, std::vector<TraceDisc> discs);
+
+  // pixels must hold 4 * width * height bytes
+  TraceStats render(uint8_t *pixels) const;
+};
@@ -1,4 +1,5 @@
 #include "engine.h"
+#include "spirv.h"
 using namespace std;
 
 void VulkanEngine::createRenderPass() {
@@ -9,7 +10,8 @@ void VulkanEngine::createRenderPass() {
                                           .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
                                           .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
                                           .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-                                          .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR};
+                                          .finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                                                  : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR};
 
   VkAttachmentReference colorAttachmentRef{
       colorAttachmentRef.attachment = 0,
@@ -22,7 +24,8 @@ void VulkanEngine::createRenderPass() {
       .pColorAttachments = &colorAttachmentRef,
   };
 
-  VkSubpassDependency dependency{
+  std::array<VkSubpassDependency, 2> dependencies{};
+  dependencies[0] = {
       .srcSubpass = VK_SUBPASS_EXTERNAL,
       .dstSubpass = 0,
       .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
@@ -30,6 +33,16 @@ void VulkanEngine::createRenderPass() {
       .srcAccessMask = 0,
       .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
   };
+  // headless copies the target out right after the pass, the implicit dependency to EXTERNAL does not
+  // order that copy after the color writes and the transition to TRANSFER_SRC_OPTIMAL
+  dependencies[1] = {
+      .srcSubpass = 0,
+      .dstSubpass = VK_SUBPASS_EXTERNAL,
+      .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+      .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+  };
 
   VkRenderPassCreateInfo renderPassInfo{
       .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
@@ -37,8 +50,8 @@ void VulkanEngine::createRenderPass() {
       .pAttachments = &colorAttachment,
       .subpassCount = 1,
       .pSubpasses = &subpass,
-      .dependencyCount = 1,
-      .pDependencies = &dependency,
+      .dependencyCount = headless ? 2u : 1u,
+      .pDependencies = dependencies.data(),
   };
 
   if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS) {
@@ -47,13 +60,9 @@ void VulkanEngine::createRenderPass() {
 }
 
 void VulkanEngine::createGraphicsPipeline() {
-  auto vertShaderCode = readFile("shaders/vert.spv");
-  auto fragShaderCode = readFile("shaders/frag.spv");
+  VkShaderModule vertShaderModule = createShaderModule(spirv::vert, sizeof(spirv::vert));
+  VkShaderModule fragShaderModule = createShaderModule(spirv::frag, sizeof(spirv::frag));
 
-  VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-  VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
-
-  // TODO use pSpecializationInfo if needed
   VkPipelineShaderStageCreateInfo vertShaderStageInfo{
       .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
       .stage = VK_SHADER_STAGE_VERTEX_BIT,
@@ -77,14 +86,21 @@ void VulkanEngine::createGraphicsPipeline() {
                                                     static_cast<uint32_t>(dynamicStates.size()),
                                                 .pDynamicStates = dynamicStates.data()};
 
-  // vertex input
-  auto bindingDescription = Vertex::getBindingDescription();
-  auto attributeDescriptions = Vertex::getAttributeDescriptions();
+  // vertex input, per-vertex mesh data in binding 0 and per-instance placement in binding 1
+  std::array<VkVertexInputBindingDescription, 2> bindingDescriptions = {
+      Vertex::getBindingDescription(vertexLayout), Instance::getBindingDescription()};
+  auto vertexAttributes = Vertex::getAttributeDescriptions(vertexLayout);
+  auto instanceAttributes = Instance::getAttributeDescriptions();
+
+  vector<VkVertexInputAttributeDescription> attributeDescriptions(vertexAttributes.begin(),
+                                                                  vertexAttributes.end());
+  attributeDescriptions.insert(attributeDescriptions.end(), instanceAttributes.begin(),
+                               instanceAttributes.end());
 
   VkPipelineVertexInputStateCreateInfo vertexInputInfo{
       .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-      .vertexBindingDescriptionCount = 1,
-      .pVertexBindingDescriptions = &bindingDescription,
+      .vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size()),
+      .pVertexBindingDescriptions = bindingDescriptions.data(),
       .vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size()),
       .pVertexAttributeDescriptions = attributeDescriptions.data()};
 
@@ -146,7 +162,10 @@ void VulkanEngine::createGraphicsPipeline() {
   colorBlending.blendConstants[2] = 0.0f;
   colorBlending.blendConstants[3] = 0.0f;
 
-  VkPipelineLayoutCreateInfo pipelineLayoutInfo{.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+  // the cull pass hands over finished clip-space instances, nothing else is bound
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                                                .setLayoutCount = 0,
+                                                .pushConstantRangeCount = 0};
 
   if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
     throw runtime_error("failed to create pipeline layout!");
@@ -169,10 +188,12 @@ void VulkanEngine::createGraphicsPipeline() {
   pipelineInfo.renderPass = renderPass;
   pipelineInfo.subpass = 0;
 
-  if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) !=
+  auto compileStart = chrono::steady_clock::now();
+  if (vkCreateGraphicsPipelines(device, pipelineCache.get(), 1, &pipelineInfo, nullptr, &graphicsPipeline) !=
       VK_SUCCESS) {
     throw runtime_error("failed to create graphics pipeline!");
   }
+  pipelineCache.recordCompile(compileStart);
 
   vkDestroyShaderModule(device, fragShaderModule, nullptr);
   vkDestroyShaderModule(device, vertShaderModule, nullptr);
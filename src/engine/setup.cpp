@@ -1,22 +1,50 @@
 #include "engine.h"
+#include <algorithm>
+#include <thread>
 #include <vulkan/vulkan_core.h>
 using namespace std;
 
+// enough for the geometry and the lensing table in one go, larger uploads stream through in chunks
+static const VkDeviceSize stagingRingSize = 16 * 1024 * 1024;
+
 void VulkanEngine::initVulkan() {
   cout << "C++ VERSION " << __cplusplus << endl;
   createInstance();
   setupDebugMessenger();
-  createSwapChain();
+  allocator.create(device, physicalDevice);
+  pipelineCache.create(device, physicalDevice, pipelineCachePath);
+  profiler.create(device, physicalDevice, findSuitableQueueFamiles(physicalDevice).graphicsFamily.value(),
+                  max_inflight_frames, !profilePath.empty());
+  if (headless) {
+    createOffscreenTarget();
+  } else {
+    createSwapChain();
+  }
   createImageViews();
   createRenderPass();
+  createDescriptorSetLayouts();
   createGraphicsPipeline();
+  createComputePipeline();
   createFramebuffers();
   createCommandPool();
-  initializeTransferBuffer();
+  if (headless)
+    createReadbackBuffers();
+  QueueFamilyIndices indices = findSuitableQueueFamiles(physicalDevice);
+  staging.create(allocator, transferQueue, indices.transferFamily.value(), indices.graphicsFamily.value(),
+                 stagingRingSize);
   createGeometries();
+  createParticleBuffers();
+  createDescriptorSets();
+  createCullResources();
+  if (lensing) {
+    createLensingResources();
+    createLensingTargets();
+  }
 
   createCommandBuffers();
   createSyncObjects();
+
+  pipelineCache.report();
 }
 
 void VulkanEngine::initWindow() {
@@ -27,6 +55,7 @@ void VulkanEngine::initWindow() {
   window = glfwCreateWindow(width, height, windowName, nullptr, nullptr);
   glfwSetWindowUserPointer(window, this); // pass arbistrary pointer
   glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+  glfwSetScrollCallback(window, scrollCallback);
 }
 
 VkResult CreateDebugUtilsMessengerEXT(VkInstance instance,
@@ -43,11 +72,16 @@ VkResult CreateDebugUtilsMessengerEXT(VkInstance instance,
 }
 
 vector<const char *> VulkanEngine::getRequiredExtensions() {
-  uint32_t glfwExtensionCount = 0;
-  const char **glfwExtensions;
-  glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+  std::vector<const char *> extensions;
+
+  // no window, no surface extensions
+  if (!headless) {
+    uint32_t glfwExtensionCount = 0;
+    const char **glfwExtensions;
+    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 
-  std::vector<const char *> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+  }
 
   if (enableValidationLayers) {
     extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -72,7 +106,7 @@ void VulkanEngine::createInstance() {
                             .pApplicationName = "Hello Triangle!",
                             .pEngineName = "No Engine",
                             .engineVersion = VK_MAKE_VERSION(1, 0, 0),
-                            .apiVersion = VK_API_VERSION_1_1};
+                            .apiVersion = VK_API_VERSION_1_2};
 
   auto extensions = getRequiredExtensions();
   VkInstanceCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -96,7 +130,8 @@ void VulkanEngine::createInstance() {
     throw runtime_error("Failed to create instance!");
   }
 
-  createSurface();
+  if (!headless)
+    createSurface();
 
   tuple<VkDevice, VkPhysicalDevice, QueueFamilies> deviceSetup;
   if (enableValidationLayers) {
@@ -109,6 +144,8 @@ void VulkanEngine::createInstance() {
   physicalDevice = get<1>(deviceSetup);
   presentQueue = get<2>(deviceSetup).presentQueue;
   graphicsQueue = get<2>(deviceSetup).graphicsQueue;
+  computeQueue = get<2>(deviceSetup).computeQueue;
+  transferQueue = get<2>(deviceSetup).transferQueue;
 }
 
 void VulkanEngine::setupDebugMessenger() {
@@ -123,7 +160,7 @@ void VulkanEngine::setupDebugMessenger() {
   }
 }
 
-void VulkanEngine::createSwapChain() {
+void VulkanEngine::createSwapChain(VkSwapchainKHR oldSwapChain) {
   SwapChainSupportDetails swapChainSupport = querySwapChainSupport(&physicalDevice);
 
   VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
@@ -149,7 +186,7 @@ void VulkanEngine::createSwapChain() {
                                                .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
                                                .presentMode = presentMode,
                                                .clipped = VK_TRUE,
-                                               .oldSwapchain = VK_NULL_HANDLE};
+                                               .oldSwapchain = oldSwapChain};
 
   // VK_SHARING_MODE_EXCLUSIVE is faster, but if the queues differ than we have to handle
   // ownership (TODO)
@@ -175,26 +212,33 @@ void VulkanEngine::createSwapChain() {
   swapChainExtent = extent;
 }
 
+VkImageView createImageView(VkImage image, VkFormat format, VkDevice *device) {
+  VkImageViewCreateInfo imageViewCreateInfo{.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                                            .image = image,
+                                            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                                            .format = format,
+                                            .components = {.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                           .g = VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                           .b = VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                           .a = VK_COMPONENT_SWIZZLE_IDENTITY},
+                                            .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                                                 .baseMipLevel = 0,
+                                                                 .levelCount = 1,
+                                                                 .baseArrayLayer = 0,
+                                                                 .layerCount = 1}};
+
+  VkImageView imageView;
+  if (vkCreateImageView(*device, &imageViewCreateInfo, nullptr, &imageView) != VK_SUCCESS) {
+    throw runtime_error("failed to create image views!");
+  }
+  return imageView;
+}
+
 void VulkanEngine::createImageViews() {
   swapChainImageViews.resize(swapChainImages.size());
 
   for (size_t i = 0; i < swapChainImages.size(); i++) {
-    VkImageViewCreateInfo imageViewCreateInfo{.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-                                              .image = swapChainImages[i],
-                                              .viewType = VK_IMAGE_VIEW_TYPE_2D,
-                                              .format = swapChainImageFormat,
-                                              .components = {.r = VK_COMPONENT_SWIZZLE_IDENTITY,
-                                                             .g = VK_COMPONENT_SWIZZLE_IDENTITY,
-                                                             .b = VK_COMPONENT_SWIZZLE_IDENTITY,
-                                                             .a = VK_COMPONENT_SWIZZLE_IDENTITY},
-                                              .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                                                                   .baseMipLevel = 0,
-                                                                   .levelCount = 1,
-                                                                   .baseArrayLayer = 0,
-                                                                   .layerCount = 1}};
-    if (vkCreateImageView(device, &imageViewCreateInfo, nullptr, &swapChainImageViews[i]) != VK_SUCCESS) {
-      throw runtime_error("failed to create image views!");
-    }
+    swapChainImageViews[i] = createImageView(swapChainImages[i], swapChainImageFormat, &device);
   }
 }
 
@@ -232,20 +276,50 @@ void VulkanEngine::createCommandPool() {
   if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
     throw runtime_error("failed to create command pool!");
   }
+
+  VkCommandPoolCreateInfo computePoolInfo{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+      .queueFamilyIndex = queueFamilyIndices.computeFamily.value(),
+  };
+
+  if (vkCreateCommandPool(device, &computePoolInfo, nullptr, &computeCommandPool) != VK_SUCCESS) {
+    throw runtime_error("failed to create compute command pool!");
+  }
 }
 
-uint32_t findMemoryType(VkPhysicalDevice *physicalDevice, uint32_t typeFilter,
-                        VkMemoryPropertyFlags properties) {
-  VkPhysicalDeviceMemoryProperties memProperties;
-  vkGetPhysicalDeviceMemoryProperties(*physicalDevice, &memProperties);
+void createImage(VkExtent2D extent, VkFormat format, VkImageUsageFlags usage, VkImage &image,
+                 Allocation &allocation, DeviceAllocator &allocator) {
+  VkImageCreateInfo imageInfo{
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = format,
+      .extent = {extent.width, extent.height, 1},
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = usage,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+  };
 
-  for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-    if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-      return i;
-    }
+  VkDevice device = allocator.getDevice();
+  if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) {
+    throw runtime_error("failed to create image!");
   }
 
-  throw runtime_error("failed to find suitable memory type!");
+  VkMemoryRequirements memRequirements;
+  vkGetImageMemoryRequirements(device, image, &memRequirements);
+
+  allocation =
+      allocator.allocate(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, ResourceTiling::Optimal);
+  vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+}
+
+void destroyImage(VkImage image, Allocation &allocation, DeviceAllocator &allocator) {
+  vkDestroyImage(allocator.getDevice(), image, nullptr);
+  allocator.free(allocation);
 }
 
 void VulkanEngine::createCommandBuffers() {
@@ -261,6 +335,52 @@ void VulkanEngine::createCommandBuffers() {
   if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
     throw runtime_error("failed to allocate command buffers!");
   }
+
+  // a pool per worker and frame slot, recording threads never share one and a whole slot resets at once
+  uint32_t workers = max(1u, thread::hardware_concurrency());
+  uint32_t graphicsFamily = findSuitableQueueFamiles(physicalDevice).graphicsFamily.value();
+  recordingPools.resize(workers * max_inflight_frames);
+  sceneDrawCaches.assign(max_inflight_frames, SceneDrawCache{});
+
+  for (uint32_t w = 0; w < workers; w++) {
+    for (uint32_t f = 0; f < max_inflight_frames; f++) {
+      VkCommandPool &pool = recordingPools[w * max_inflight_frames + f];
+      VkCommandPoolCreateInfo poolInfo{
+          .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+          .queueFamilyIndex = graphicsFamily,
+      };
+
+      if (vkCreateCommandPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+        throw runtime_error("failed to create recording command pool!");
+      }
+
+      VkCommandBufferAllocateInfo secondaryAllocInfo{
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+          .commandPool = pool,
+          .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+          .commandBufferCount = 1,
+      };
+
+      VkCommandBuffer secondary;
+      if (vkAllocateCommandBuffers(device, &secondaryAllocInfo, &secondary) != VK_SUCCESS) {
+        throw runtime_error("failed to allocate scene draw command buffers!");
+      }
+      sceneDrawCaches[f].commandBuffers.push_back(secondary);
+    }
+  }
+
+  computeCommandBuffers.resize(max_inflight_frames);
+
+  VkCommandBufferAllocateInfo computeAllocInfo{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = computeCommandPool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = (uint32_t)computeCommandBuffers.size(),
+  };
+
+  if (vkAllocateCommandBuffers(device, &computeAllocInfo, computeCommandBuffers.data()) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate compute command buffers!");
+  }
 }
 
 void VulkanEngine::createSyncObjects() {
@@ -270,18 +390,52 @@ void VulkanEngine::createSyncObjects() {
 
   imageAvailableSemaphores.resize(max_inflight_frames);
   renderFinishedSemaphores.resize(max_inflight_frames);
+  computeFinishedSemaphores.resize(max_inflight_frames);
   inFlightFences.resize(max_inflight_frames);
 
   for (size_t i = 0; i < max_inflight_frames; i++) {
     if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
         vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
+        vkCreateSemaphore(device, &semaphoreInfo, nullptr, &computeFinishedSemaphores[i]) != VK_SUCCESS ||
         vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
       throw runtime_error("failed to create semaphores!");
     }
   }
 }
 
+VkSwapchainKHR VulkanEngine::retireSwapChain() {
+  retiredSwapChains.push_back({.swapChain = swapChain,
+                               .imageViews = std::move(swapChainImageViews),
+                               .framebuffers = std::move(swapChainFramebuffers),
+                               .retiredAt = submittedFrames});
+  swapChainImageViews.clear();
+  swapChainFramebuffers.clear();
+  return swapChain;
+}
+
+// frame k's fence is waited at the start of frame k + max_inflight_frames, so right after that wait every
+// frame up to submittedFrames - max_inflight_frames has finished. the presentation engine has no fence
+// without VK_EXT_swapchain_maintenance1, the frame fences stand in for the last presents as well
+void VulkanEngine::releaseRetiredSwapChains(bool all) {
+  while (!retiredSwapChains.empty()) {
+    RetiredSwapChain &retired = retiredSwapChains.front();
+    if (!all && retired.retiredAt + max_inflight_frames > submittedFrames + 1)
+      return;
+
+    for (VkFramebuffer framebuffer : retired.framebuffers) {
+      vkDestroyFramebuffer(device, framebuffer, nullptr);
+    }
+    for (VkImageView imageView : retired.imageViews) {
+      vkDestroyImageView(device, imageView, nullptr);
+    }
+    vkDestroySwapchainKHR(device, retired.swapChain, nullptr);
+    retiredSwapChains.pop_front();
+  }
+}
+
 void VulkanEngine::cleanupSwapChain() {
+  releaseRetiredSwapChains(true);
+
   for (auto framebuffer : swapChainFramebuffers) {
     vkDestroyFramebuffer(device, framebuffer, nullptr);
   }
@@ -290,19 +444,44 @@ void VulkanEngine::cleanupSwapChain() {
     vkDestroyImageView(device, imageView, nullptr);
   }
 
+  if (lensing)
+    cleanupLensingTargets();
+
+  if (headless) {
+    cleanupOffscreenTarget();
+    return;
+  }
+
   vkDestroySwapchainKHR(device, swapChain, nullptr);
 }
 
 void VulkanEngine::cleanup() {
+  // already stopped unless the render loop threw
+  stopSimulationThread();
+
   for (size_t i = 0; i < max_inflight_frames; i++) {
     vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
     vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+    vkDestroySemaphore(device, computeFinishedSemaphores[i], nullptr);
     vkDestroyFence(device, inFlightFences[i], nullptr);
   }
 
   vkDestroyCommandPool(device, commandPool, nullptr);
+  for (VkCommandPool pool : recordingPools) {
+    vkDestroyCommandPool(device, pool, nullptr);
+  }
+
+  cleanupCompute();
+  cleanupCulling();
+  if (lensing)
+    cleanupLensing();
 
   vkDestroyPipeline(device, graphicsPipeline, nullptr);
+  pipelineCache.save();
+  pipelineCache.destroy();
+  if (profiler.isEnabled())
+    profiler.write(profilePath);
+  profiler.destroy();
   vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
   vkDestroyRenderPass(device, renderPass, nullptr);
 
@@ -312,12 +491,27 @@ void VulkanEngine::cleanup() {
     // vkDestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
   }
 
-  vkFreeCommandBuffers(device, commandPool, 1, &transferCommandBuffer);
+  staging.destroy();
+  rigidBodyManager.cleanup();
+
+  for (size_t i = 0; i < readbackBuffers.size(); i++) {
+    destroyBuffer(readbackBuffers[i], readbackMemory[i], allocator);
+  }
+
+  // everything above has handed its memory back
+  AllocatorStats memory = allocator.stats();
+  cout << "device memory: " << memory.blocks << " blocks, " << memory.reserved / 1024 << " KiB reserved, "
+       << memory.requested / 1024 << " KiB still in use" << endl;
+  allocator.destroy();
 
-  vkDestroySurfaceKHR(instance, surface, nullptr);
+  if (!headless)
+    vkDestroySurfaceKHR(instance, surface, nullptr);
 
   vkDestroyInstance(instance, nullptr);
 
+  if (headless)
+    return;
+
   glfwDestroyWindow(window);
 
   glfwTerminate();
@@ -1,5 +1,4 @@
 #include "engine.h"
-#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -8,28 +7,10 @@
 
 using namespace std;
 
-vector<char> readFile(const std::string &filename) {
-  ifstream file(filename, ios::ate | ios::binary);
-
-  if (!file.is_open()) {
-    throw runtime_error("failed to open file!");
-  }
-
-  size_t fileSize = (size_t)file.tellg();
-  vector<char> buffer(fileSize);
-
-  file.seekg(0);
-  file.read(buffer.data(), fileSize);
-
-  file.close();
-
-  return buffer;
-}
-
-VkShaderModule VulkanEngine::createShaderModule(const std::vector<char> &code) {
+VkShaderModule VulkanEngine::createShaderModule(const uint32_t *code, size_t codeSize) {
   VkShaderModuleCreateInfo shaderCreateInfo{.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-                                            .codeSize = code.size(),
-                                            .pCode = reinterpret_cast<const uint32_t *>(code.data())};
+                                            .codeSize = codeSize,
+                                            .pCode = code};
 
   VkShaderModule shaderModule;
   if (vkCreateShaderModule(device, &shaderCreateInfo, nullptr, &shaderModule) != VK_SUCCESS) {
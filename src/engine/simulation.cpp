@@ -0,0 +1,72 @@
+#include "engine.h"
+#include <algorithm>
+
+using namespace std;
+
+// this many periods behind schedule the simulation stops catching up and drops the lost time instead
+static const int maxPeriodsBehind = 4;
+
+static void copyPositions(const ParticleStore &particles, vector<glm::vec2> &positions) {
+  positions.resize(particles.size());
+  for (size_t i = 0; i < particles.size(); i++) {
+    positions[i] = {particles.x[i], particles.y[i]};
+  }
+}
+
+void VulkanEngine::startSimulationThread() {
+  simulationRunning = true;
+  simulationThread = thread(&VulkanEngine::simulationLoop, this);
+}
+
+void VulkanEngine::stopSimulationThread() {
+  simulationRunning = false;
+  if (simulationThread.joinable())
+    simulationThread.join();
+}
+
+// fixed steps on a wall clock schedule, a step that overruns only delays the ones after it
+void VulkanEngine::simulationLoop() {
+  auto period =
+      chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / simulationRate));
+
+  vector<glm::vec2> last;
+  copyPositions(particles, last);
+
+  auto next = chrono::steady_clock::now();
+  while (simulationRunning.load(memory_order_relaxed)) {
+    solver.step(particles, simulationDt);
+
+    // the slot keeps its capacity, after the first few steps this allocates nothing
+    SimulationSnapshot &snapshot = simulationSnapshots.writeSlot();
+    snapshot.previous.assign(last.begin(), last.end());
+    copyPositions(particles, last);
+    snapshot.current.assign(last.begin(), last.end());
+    snapshot.published = chrono::steady_clock::now();
+    simulationSnapshots.publish();
+
+    next += period;
+    auto now = chrono::steady_clock::now();
+    if (now - next > maxPeriodsBehind * period)
+      next = now;
+    this_thread::sleep_until(next);
+  }
+}
+
+// draws the simulation one step behind, blending the last two steps by the time since the newer one was
+// published. snapshots are spaced one period apart while the simulation keeps up, so the blend is continuous
+void VulkanEngine::interpolateSimulation() {
+  simulationSnapshots.update();
+  const SimulationSnapshot &snapshot = simulationSnapshots.readSlot();
+  if (snapshot.current.empty())
+    return;
+
+  float since = chrono::duration<float>(chrono::steady_clock::now() - snapshot.published).count();
+  float alpha = clamp(since * simulationRate, 0.0f, 1.0f);
+
+  auto &instances = rigidBodyManager.geometries.at(circleGeometry).instances;
+  for (size_t i = 0; i < snapshot.current.size(); i++) {
+    instances[i].center = glm::mix(snapshot.previous[i], snapshot.current[i], alpha);
+  }
+
+  rigidBodyManager.markInstancesDirty();
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// refers to a value in a SlotMap, erasing the value makes the handle stale instead of pointing at whatever
+// reuses the slot
+struct SlotHandle {
+  uint32_t index = UINT32_MAX;
+  uint32_t generation = 0;
+
+  bool operator==(const SlotHandle &other) const = default;
+};
+
+// values packed densely in insertion order, with erase swapping the last one into the hole. handles go
+// through a slot table that follows those moves, so insert, erase and lookup are O(1) and iterating is a
+// linear scan of one array. each value is stored whole, so SlotMap<RigidBody> is an array of structs and
+// not split into per-field arrays
+template <typename T> class SlotMap {
+private:
+  struct Slot {
+    // the value's dense index while live, the next free slot while free
+    uint32_t dense;
+    // odd while live, bumped on insert and on erase
+    uint32_t generation = 0;
+  };
+
+  std::vector<T> values;
+  // slot of each dense value, for fixing up the slot table when erase moves the last value
+  std::vector<uint32_t> owners;
+  std::vector<Slot> slots;
+  uint32_t freeSlot = UINT32_MAX;
+
+  bool live(SlotHandle handle) const {
+    return handle.index < slots.size() && slots[handle.index].generation == handle.generation &&
+           (handle.generation & 1);
+  }
+
+public:
+  SlotHandle insert(T value) {
+    uint32_t index = freeSlot;
+    if (index == UINT32_MAX) {
+      index = static_cast<uint32_t>(slots.size());
+      slots.push_back({});
+    } else {
+      freeSlot = slots[index].dense;
+    }
+
+    Slot &slot = slots[index];
+    slot.dense = static_cast<uint32_t>(values.size());
+    slot.generation++;
+    values.push_back(std::move(value));
+    owners.push_back(index);
+    return {.index = index, .generation = slot.generation};
+  }
+
+  // returns false for a stale handle
+  bool erase(SlotHandle handle) {
+    if (!live(handle))
+      return false;
+
+    Slot &slot = slots[handle.index];
+    uint32_t last = static_cast<uint32_t>(values.size()) - 1;
+    if (slot.dense != last) {
+      values[slot.dense] = std::move(values[last]);
+      owners[slot.dense] = owners[last];
+      slots[owners[last]].dense = slot.dense;
+    }
+    values.pop_back();
+    owners.pop_back();
+
+    slot.generation++;
+    slot.dense = freeSlot;
+    freeSlot = handle.index;
+    return true;
+  }
+
+  void clear() {
+    for (uint32_t owner : owners) {
+      slots[owner].generation++;
+      slots[owner].dense = freeSlot;
+      freeSlot = owner;
+    }
+    values.clear();
+    owners.clear();
+  }
+
+  bool contains(SlotHandle handle) const { return live(handle); }
+  // nullptr for a stale handle
+  T *get(SlotHandle handle) { return live(handle) ? &values[slots[handle.index].dense] : nullptr; }
+  const T *get(SlotHandle handle) const {
+    return live(handle) ? &values[slots[handle.index].dense] : nullptr;
+  }
+  T &at(SlotHandle handle) {
+    if (!live(handle)) {
+      throw std::out_of_range("stale slot map handle!");
+    }
+    return values[slots[handle.index].dense];
+  }
+
+  // dense order, which erase reshuffles
+  size_t size() const { return values.size(); }
+  bool empty() const { return values.empty(); }
+  T &valueAt(size_t dense) { return values[dense]; }
+  const T &valueAt(size_t dense) const { return values[dense]; }
+  SlotHandle handleAt(size_t dense) const {
+    return {.index = owners[dense], .generation = slots[owners[dense]].generation};
+  }
+  auto begin() { return values.begin(); }
+  auto end() { return values.end(); }
+  auto begin() const { return values.begin(); }
+  auto end() const { return values.end(); }
+};
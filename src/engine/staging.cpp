@@ -0,0 +1,323 @@
+#include "engine.h"
+#include <algorithm>
+#include <vulkan/vulkan_core.h>
+
+using namespace std;
+
+void StagingRing::create(DeviceAllocator &allocator, VkQueue queue, uint32_t family, uint32_t consumerFamily,
+                         VkDeviceSize capacity) {
+  this->device = allocator.getDevice();
+  this->allocator = &allocator;
+  this->queue = queue;
+  this->family = family;
+  this->consumerFamily = consumerFamily;
+  this->capacity = capacity;
+
+  createBuffer(capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer, memory,
+               allocator);
+  mapped = static_cast<uint8_t *>(memory.mapped);
+
+  VkCommandPoolCreateInfo poolInfo{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+      .queueFamilyIndex = family,
+  };
+
+  if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
+    throw runtime_error("failed to create staging command pool!");
+  }
+
+  // every batch signals its ticket, so one semaphore orders all of them for the host and other queues
+  VkSemaphoreTypeCreateInfo typeInfo{
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+      .initialValue = 0,
+  };
+  VkSemaphoreCreateInfo semaphoreInfo{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, .pNext = &typeInfo};
+
+  if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &timeline) != VK_SUCCESS) {
+    throw runtime_error("failed to create staging timeline semaphore!");
+  }
+}
+
+void StagingRing::destroy() {
+  while (!inFlight.empty())
+    retireOldest(true);
+
+  if (recording)
+    idle.push_back(*recording);
+  recording.reset();
+  idle.clear();
+  bufferAcquires.clear();
+  imageAcquires.clear();
+
+  // frees the command buffers as well
+  vkDestroyCommandPool(device, commandPool, nullptr);
+  vkDestroySemaphore(device, timeline, nullptr);
+
+  destroyBuffer(buffer, memory, *allocator);
+}
+
+StagingRing::Batch &StagingRing::open() {
+  if (recording)
+    return *recording;
+
+  Batch batch{};
+  if (!idle.empty()) {
+    batch = idle.back();
+    idle.pop_back();
+  } else {
+    VkCommandBufferAllocateInfo allocInfo{
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+
+    if (vkAllocateCommandBuffers(device, &allocInfo, &batch.commandBuffer) != VK_SUCCESS) {
+      throw runtime_error("failed to allocate staging command buffer!");
+    }
+  }
+
+  VkCommandBufferBeginInfo beginInfo{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  vkBeginCommandBuffer(batch.commandBuffer, &beginInfo);
+
+  batch.size = 0;
+  recording = batch;
+  return *recording;
+}
+
+bool StagingRing::retireOldest(bool wait) {
+  Batch &batch = inFlight.front();
+
+  if (wait) {
+    VkSemaphoreWaitInfo waitInfo{
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &timeline,
+        .pValues = &batch.ticket,
+    };
+    vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+  } else {
+    uint64_t reached;
+    vkGetSemaphoreCounterValue(device, timeline, &reached);
+    if (reached < batch.ticket)
+      return false;
+  }
+
+  vkResetCommandBuffer(batch.commandBuffer, 0);
+
+  used -= batch.size;
+  completedTicket = batch.ticket;
+  idle.push_back(batch);
+  inFlight.pop_front();
+
+  // nothing left in flight, start over from the front instead of wrapping later
+  if (used == 0)
+    head = 0;
+  return true;
+}
+
+VkDeviceSize StagingRing::stage(const void *data, VkDeviceSize size, VkDeviceSize alignment) {
+  if (size > capacity) {
+    throw runtime_error("staging upload larger than the ring!");
+  }
+
+  reclaim();
+
+  VkDeviceSize offset, taken;
+  while (true) {
+    offset = (head + alignment - 1) / alignment * alignment;
+    taken = offset - head + size;
+
+    // no room before the end, skip the rest and wrap to the front
+    if (offset + size > capacity) {
+      offset = 0;
+      taken = capacity - head + size;
+    }
+
+    if (used + taken <= capacity)
+      break;
+
+    // the open batch holds space too, it has to be in flight before anything can free up
+    if (recording && recording->size > 0)
+      submit();
+    if (inFlight.empty()) {
+      throw runtime_error("staging ring exhausted!");
+    }
+    retireOldest(true);
+  }
+
+  open().size += taken;
+  used += taken;
+  head = offset + size;
+
+  memcpy(mapped + offset, data, size);
+  stagedBytes += size;
+  return offset;
+}
+
+VkCommandBuffer StagingRing::commandBuffer() { return open().commandBuffer; }
+
+void StagingRing::uploadBuffer(const void *data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset,
+                               bool shared) {
+  // half the ring per chunk keeps one chunk copying while the next is written
+  const VkDeviceSize chunk = capacity / 2;
+
+  for (VkDeviceSize done = 0; done < size; done += chunk) {
+    VkDeviceSize length = min(chunk, size - done);
+    VkDeviceSize offset = stage(static_cast<const uint8_t *>(data) + done, length);
+
+    VkBufferCopy copyRegion{
+        .srcOffset = offset,
+        .dstOffset = dstOffset + done,
+        .size = length,
+    };
+    vkCmdCopyBuffer(commandBuffer(), buffer, dst, 1, &copyRegion);
+  }
+
+  if (shared || !transfersOwnership())
+    return;
+
+  // chunks copied in earlier batches came before this one on the same queue, one release covers them all
+  VkBufferMemoryBarrier release{
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = 0,
+      .srcQueueFamilyIndex = family,
+      .dstQueueFamilyIndex = consumerFamily,
+      .buffer = dst,
+      .offset = dstOffset,
+      .size = size,
+  };
+  vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                       0, 0, nullptr, 1, &release, 0, nullptr);
+
+  VkBufferMemoryBarrier acquire = release;
+  acquire.srcAccessMask = 0;
+  acquire.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+  bufferAcquires.push_back({nextTicket, acquire});
+}
+
+void StagingRing::releaseImage(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout) {
+  VkImageMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+      .oldLayout = oldLayout,
+      .newLayout = newLayout,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = image,
+      .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                           .baseMipLevel = 0,
+                           .levelCount = 1,
+                           .baseArrayLayer = 0,
+                           .layerCount = 1},
+  };
+
+  // same queue, a plain transition does it
+  if (!transfersOwnership()) {
+    vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, consumerStages, 0, 0, nullptr, 0,
+                         nullptr, 1, &barrier);
+    return;
+  }
+
+  // the transfer queue cannot name the shader stages, its half only releases. both halves repeat the
+  // layout change and it runs once
+  barrier.dstAccessMask = 0;
+  barrier.srcQueueFamilyIndex = family;
+  barrier.dstQueueFamilyIndex = consumerFamily;
+  vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                       0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  imageAcquires.push_back({nextTicket, barrier});
+}
+
+uint64_t StagingRing::submit() {
+  if (!recording)
+    return nextTicket - 1;
+
+  Batch batch = *recording;
+  recording.reset();
+
+  VkMemoryBarrier barrier{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT,
+  };
+  vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+  vkEndCommandBuffer(batch.commandBuffer);
+
+  batch.ticket = nextTicket++;
+  VkTimelineSemaphoreSubmitInfo timelineInfo{
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .signalSemaphoreValueCount = 1,
+      .pSignalSemaphoreValues = &batch.ticket,
+  };
+  VkSubmitInfo submitInfo{
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .pNext = &timelineInfo,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &batch.commandBuffer,
+      .signalSemaphoreCount = 1,
+      .pSignalSemaphores = &timeline,
+  };
+
+  if (vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+    throw runtime_error("failed to submit staging batch!");
+  }
+
+  inFlight.push_back(batch);
+  return batch.ticket;
+}
+
+void StagingRing::wait(uint64_t ticket) {
+  while (completedTicket < ticket && !inFlight.empty())
+    retireOldest(true);
+}
+
+void StagingRing::reclaim() {
+  while (!inFlight.empty() && retireOldest(false)) {
+  }
+}
+
+uint64_t StagingRing::acquire(VkCommandBuffer commandBuffer) {
+  // releases still in the open batch would make the consumer wait on a value nothing signals yet
+  uint64_t submitted = nextTicket - 1;
+  uint64_t waitValue = 0;
+
+  vector<VkBufferMemoryBarrier> buffers;
+  erase_if(bufferAcquires, [&](const pair<uint64_t, VkBufferMemoryBarrier> &entry) {
+    if (entry.first > submitted)
+      return false;
+    buffers.push_back(entry.second);
+    waitValue = max(waitValue, entry.first);
+    return true;
+  });
+
+  vector<VkImageMemoryBarrier> images;
+  erase_if(imageAcquires, [&](const pair<uint64_t, VkImageMemoryBarrier> &entry) {
+    if (entry.first > submitted)
+      return false;
+    images.push_back(entry.second);
+    waitValue = max(waitValue, entry.first);
+    return true;
+  });
+
+  if (waitValue == 0)
+    return 0;
+
+  // the frame's semaphore wait covers consumerStages, chaining it into this barrier
+  vkCmdPipelineBarrier(commandBuffer, consumerStages, consumerStages, 0, 0, nullptr,
+                       static_cast<uint32_t>(buffers.size()), buffers.data(),
+                       static_cast<uint32_t>(images.size()), images.data());
+  return waitValue;
+}
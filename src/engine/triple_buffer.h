@@ -0,0 +1,31 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// hands the newest value from one writer thread to one reader thread without locks. the writer fills its
+// own slot and swaps it with the shared middle slot, the reader swaps the middle slot for its own only when
+// it holds something new. neither side ever waits, and values the reader was too slow for are dropped
+template <typename T> class TripleBuffer {
+private:
+  // set on the middle index while it holds a value the reader has not taken yet
+  static constexpr uint8_t freshBit = 4;
+
+  T slots[3];
+  std::atomic<uint8_t> middle{1};
+  // owned by the writer and the reader respectively
+  uint8_t back = 0, front = 2;
+
+public:
+  // writer side: fill writeSlot() completely, then publish() it. the next writeSlot() holds stale data
+  T &writeSlot() { return slots[back]; }
+  void publish() { back = middle.exchange(back | freshBit, std::memory_order_acq_rel) & ~freshBit; }
+
+  // reader side: returns whether readSlot() now holds a newer value than before
+  bool update() {
+    if (!(middle.load(std::memory_order_acquire) & freshBit))
+      return false;
+    front = middle.exchange(front, std::memory_order_acq_rel) & ~freshBit;
+    return true;
+  }
+  const T &readSlot() const { return slots[front]; }
+};
@@ -1,94 +1,152 @@
 #include "engine.h"
-#include <format>
+#include <algorithm>
+#include <cstring>
+#include <glm/gtc/packing.hpp>
 #include <iostream>
+#include <random>
 #include <string>
 
 #include <vulkan/vulkan_core.h>
 
 using namespace std;
 
-void VulkanEngine::initializeTransferBuffer() {
-  VkCommandBufferAllocateInfo allocInfo{
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-      .commandPool = commandPool,
-      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-      .commandBufferCount = 1,
-  };
-
-  vkAllocateCommandBuffers(device, &allocInfo, &this->transferCommandBuffer);
-}
-
-void VulkanEngine::beginTransfers() {
-  VkCommandBufferBeginInfo beginInfo{
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+                  VkBuffer &buffer, Allocation &allocation, DeviceAllocator &allocator,
+                  const std::vector<uint32_t> &queueFamilies) {
+  VkBufferCreateInfo bufferInfo{
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = size,
+      .usage = usage,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
   };
 
-  vkBeginCommandBuffer(this->transferCommandBuffer, &beginInfo);
-}
+  vector<uint32_t> families = queueFamilies;
+  sort(families.begin(), families.end());
+  families.erase(unique(families.begin(), families.end()), families.end());
+  if (families.size() > 1) {
+    bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    bufferInfo.queueFamilyIndexCount = static_cast<uint32_t>(families.size());
+    bufferInfo.pQueueFamilyIndices = families.data();
+  }
 
-void VulkanEngine::endTransfers() {
-  vkEndCommandBuffer(this->transferCommandBuffer);
+  VkDevice device = allocator.getDevice();
+  if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+    throw runtime_error("failed to create buffer!");
+  }
 
-  VkSubmitInfo submitInfo{
-      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .commandBufferCount = 1,
-      .pCommandBuffers = &this->transferCommandBuffer,
-  };
+  VkMemoryRequirements memRequirements;
+  vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-  vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+  allocation = allocator.allocate(memRequirements, properties, ResourceTiling::Linear);
+  vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
 }
 
-void VulkanEngine::waitForTransfers() {
-  // vkWaitForFences(device, 1, &transferFence, VK_TRUE, UINT64_MAX);
-  vkQueueWaitIdle(graphicsQueue);
+void destroyBuffer(VkBuffer buffer, Allocation &allocation, DeviceAllocator &allocator) {
+  vkDestroyBuffer(allocator.getDevice(), buffer, nullptr);
+  allocator.free(allocation);
 }
 
-void VulkanEngine::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-  VkBufferCopy copyRegion{
-      copyRegion.srcOffset = 0,
-      copyRegion.dstOffset = 0,
-      copyRegion.size = size,
-  };
-  vkCmdCopyBuffer(this->transferCommandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+uint32_t Vertex::stride(VertexLayout layout) {
+  // position then color, tightly packed
+  return layout == VertexLayout::Float ? sizeof(Vertex) : 2 * sizeof(uint32_t);
 }
 
-void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
-                  VkBuffer &buffer, VkDeviceMemory &bufferMemory, VkDeviceSize offset, VkDevice *device,
-                  VkPhysicalDevice *physDevice) {
-  VkBufferCreateInfo bufferInfo{
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .size = size,
-      .usage = usage,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-  };
+VkVertexInputBindingDescription Vertex::getBindingDescription(VertexLayout layout) {
+  return {.binding = 0, .stride = stride(layout), .inputRate = VK_VERTEX_INPUT_RATE_VERTEX};
+}
 
-  if (vkCreateBuffer(*device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
-    throw runtime_error("failed to create buffer!");
+// the shader reads vec2 and vec3 either way, the compact formats are widened to float on fetch
+array<VkVertexInputAttributeDescription, 2> Vertex::getAttributeDescriptions(VertexLayout layout) {
+  if (layout == VertexLayout::Float) {
+    return {{
+        {.location = 0, .binding = 0, .format = VK_FORMAT_R32G32_SFLOAT, .offset = offsetof(Vertex, pos)},
+        {.location = 1,
+         .binding = 0,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = offsetof(Vertex, color)},
+    }};
   }
 
-  VkMemoryRequirements memRequirements;
-  vkGetBufferMemoryRequirements(*device, buffer, &memRequirements);
-
-  VkMemoryAllocateInfo allocInfo{
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memRequirements.size,
-      .memoryTypeIndex = findMemoryType(physDevice, memRequirements.memoryTypeBits, properties),
-  };
+  VkFormat position = layout == VertexLayout::Half ? VK_FORMAT_R16G16_SFLOAT : VK_FORMAT_R16G16_SNORM;
+  return {{
+      {.location = 0, .binding = 0, .format = position, .offset = 0},
+      {.location = 1, .binding = 0, .format = VK_FORMAT_R8G8B8A8_UNORM, .offset = sizeof(uint32_t)},
+  }};
+}
 
-  if (vkAllocateMemory(*device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
-    throw runtime_error("failed to allocate buffer memory!");
+void Vertex::pack(VertexLayout layout, const Vertex *vertices, size_t count, uint8_t *dst) {
+  if (layout == VertexLayout::Float) {
+    memcpy(dst, vertices, count * sizeof(Vertex));
+    return;
   }
 
-  vkBindBufferMemory(*device, buffer, bufferMemory, offset);
+  uint32_t *packed = reinterpret_cast<uint32_t *>(dst);
+  for (size_t i = 0; i < count; i++) {
+    const Vertex &vertex = vertices[i];
+    if (layout == VertexLayout::Snorm16 && (abs(vertex.pos.x) > 1.0f || abs(vertex.pos.y) > 1.0f)) {
+      throw runtime_error("mesh does not fit the snorm16 vertex layout, use the float layout!");
+    }
+
+    packed[2 * i] =
+        layout == VertexLayout::Half ? glm::packHalf2x16(vertex.pos) : glm::packSnorm2x16(vertex.pos);
+    packed[2 * i + 1] = glm::packUnorm4x8(glm::vec4(vertex.color, 1.0f));
+  }
 }
 
 void VulkanEngine::createGeometries() {
-  for (int i = 0; i < 10; i++)
-    for (int j = 0; j < 10; j++)
-      this->rigidBodyManager.geometries.insert(
-          {std::format("N {} {}", i, j),
-           RigidBody::createSphere(0.075 * i - 0.5, 0.075 * j - 0.5, 0.05, {0.0f, 0.0f, 1.0f})});
+  rigidBodyManager.vertexLayout = vertexLayout;
+
+  // one shared unit circle, every body is an instance of it
+  RigidBody circle = RigidBody::createCircleLods({1.0f, 1.0f, 1.0f});
+  if (simulation != SimulationBackend::None) {
+    createOrbitScene(circle);
+  } else {
+    buildGridScene(gridBodyCount, circle.instances);
+  }
+
+  circleGeometry = this->rigidBodyManager.addGeometry(std::move(circle), "circle");
 
   this->rigidBodyManager.loadToGpu();
 }
+
+void VulkanEngine::createOrbitScene(RigidBody &circle) {
+  buildOrbitScene(simulatedBodyCount, solver.G, particles, circle.instances);
+}
+
+void buildGridScene(uint32_t bodyCount, std::vector<Instance> &instances) {
+  // the grid keeps the same footprint at any count, the bodies shrink to fit
+  uint32_t side = static_cast<uint32_t>(ceil(sqrt(static_cast<double>(bodyCount))));
+  float spacing = 0.75f / side;
+
+  instances.reserve(instances.size() + bodyCount);
+  for (uint32_t n = 0; n < bodyCount; n++) {
+    uint32_t i = n / side, j = n % side;
+    instances.push_back({.center = {spacing * i - 0.5f, spacing * j - 0.5f},
+                         .radius = spacing * 2.0f / 3.0f,
+                         .color = {0.0f, 0.0f, 1.0f}});
+  }
+}
+
+void buildOrbitScene(uint32_t bodyCount, float G, ParticleStore &particles,
+                     std::vector<Instance> &instances) {
+  // central black hole, everything else starts on a circular orbit around it
+  const float centralMass = 1.0f;
+  particles.clear();
+  particles.add(0.0f, 0.0f, 0.0f, 0.0f, centralMass);
+  instances.push_back({.center = {0.0f, 0.0f}, .radius = 0.03f, .color = {1.0f, 0.6f, 0.2f}});
+
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> radius(0.15f, 0.9f), angle(0.0f, 2 * PI);
+
+  for (uint32_t i = 1; i < bodyCount; i++) {
+    float r = radius(rng), phi = angle(rng);
+    float speed = sqrtf(G * centralMass / r);
+    float x = r * cosf(phi), y = r * sinf(phi);
+
+    // one body in ten carries mass, the rest are test particles
+    bool massive = i % 10 == 0;
+    glm::vec3 color = massive ? glm::vec3(1.0f, 1.0f, 1.0f) : glm::vec3(0.3f, 0.5f, 1.0f);
+    particles.add(x, y, -speed * sinf(phi), speed * cosf(phi), massive ? 1e-5f : 0.0f);
+    instances.push_back({.center = {x, y}, .radius = massive ? 0.006f : 0.003f, .color = color});
+  }
+}
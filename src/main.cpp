@@ -1,12 +1,161 @@
 #include "engine/engine.h"
+#include "engine/gravity.h"
+#include "engine/raytracer.h"
+#include <cmath>
 #include <cstdlib>
+#include <stdexcept>
+#include <string>
 #include <vulkan/vulkan.h>
 
 using namespace std;
 
-int main() {
-  VulkanEngine engine(800, 800, 2, true, "Vulkan Engine working!");
+static void printUsage(const char *program) {
+  cerr << "usage: " << program << " [--headless] [--frames N] [--output frame.ppm]"
+       << " [--simulate cpu|gpu] [--bodies N] [--sim-rate steps/s] [--lensing] [--no-validation]"
+       << " [--check-gravity] [--report perf.json] [--vertex-layout float|half|snorm16]"
+       << " [--trace frame.ppm] [--pipeline-cache file] [--profile trace.json]" << endl;
+}
+
+// the whole value has to be a number above zero, anything else throws with the option named. stoul would
+// wrap a negative number around
+static uint32_t parseCount(const string &option, const string &value) {
+  size_t end = 0;
+  unsigned long count = 0;
+  try {
+    count = stoul(value, &end);
+  } catch (const logic_error &) {
+  }
+  if (end == 0 || end != value.size() || value.find('-') != string::npos || count == 0 || count > UINT32_MAX)
+    throw invalid_argument(option + " takes a whole number above zero, not '" + value + "'");
+  return static_cast<uint32_t>(count);
+}
+
+static float parseRate(const string &option, const string &value) {
+  size_t end = 0;
+  float rate = 0.0f;
+  try {
+    rate = stof(value, &end);
+  } catch (const logic_error &) {
+  }
+  if (end == 0 || end != value.size() || !(rate > 0.0f) || isinf(rate))
+    throw invalid_argument(option + " takes a number above zero, not '" + value + "'");
+  return rate;
+}
+
+int main(int argc, char **argv) {
+  bool headless = false;
+  bool validation = true;
+  bool lensing = false;
+  SimulationBackend simulation = SimulationBackend::None;
+  uint32_t frames = 1000;
+  // the orbit scene and the grid scene have different defaults, --bodies sets both
+  uint32_t bodies = 10000;
+  uint32_t gridBodies = 100;
+  float simulationRate = 60.0f;
+  string output;
+  string tracePath;
+  string pipelineCachePath = "pipeline_cache.bin";
+  string profilePath;
+  string reportPath;
+  VertexLayout vertexLayout = VertexLayout::Snorm16;
+
+  // a bad value ends in the usage message, not in terminate
+  try {
+    for (int i = 1; i < argc; i++) {
+      string arg = argv[i];
+      if (arg == "--headless") {
+        headless = true;
+      } else if (arg == "--frames" && i + 1 < argc) {
+        frames = parseCount(arg, argv[++i]);
+      } else if (arg == "--output" && i + 1 < argc) {
+        output = argv[++i];
+      } else if (arg == "--simulate" && i + 1 < argc) {
+        string backend = argv[++i];
+        if (backend != "cpu" && backend != "gpu") {
+          cerr << "--simulate takes cpu or gpu" << endl;
+          return EXIT_FAILURE;
+        }
+        simulation = backend == "cpu" ? SimulationBackend::Cpu : SimulationBackend::Gpu;
+      } else if (arg == "--bodies" && i + 1 < argc) {
+        bodies = gridBodies = parseCount(arg, argv[++i]);
+      } else if (arg == "--sim-rate" && i + 1 < argc) {
+        simulationRate = parseRate(arg, argv[++i]);
+      } else if (arg == "--lensing") {
+        lensing = true;
+      } else if (arg == "--no-validation") {
+        validation = false;
+      } else if (arg == "--check-gravity") {
+        return checkGravityKernels() ? EXIT_SUCCESS : EXIT_FAILURE;
+      } else if (arg == "--trace" && i + 1 < argc) {
+        tracePath = argv[++i];
+      } else if (arg == "--pipeline-cache" && i + 1 < argc) {
+        pipelineCachePath = argv[++i];
+      } else if (arg == "--profile" && i + 1 < argc) {
+        profilePath = argv[++i];
+      } else if (arg == "--vertex-layout" && i + 1 < argc) {
+        string layout = argv[++i];
+        if (layout != "float" && layout != "half" && layout != "snorm16") {
+          cerr << "--vertex-layout takes float, half or snorm16" << endl;
+          return EXIT_FAILURE;
+        }
+        vertexLayout = layout == "float"  ? VertexLayout::Float
+                       : layout == "half" ? VertexLayout::Half
+                                          : VertexLayout::Snorm16;
+      } else if (arg == "--report" && i + 1 < argc) {
+        reportPath = argv[++i];
+      } else {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+  } catch (const logic_error &e) {
+    cerr << e.what() << endl;
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // offline reference frame of the initial orbit scene, no Vulkan involved
+  if (!tracePath.empty()) {
+    ParticleStore particles;
+    vector<Instance> instances;
+    buildOrbitScene(bodies, 1.0f, particles, instances);
+
+    vector<TraceDisc> discs;
+    discs.reserve(instances.size());
+    for (const Instance &instance : instances) {
+      discs.push_back({.x = instance.center.x,
+                       .y = instance.center.y,
+                       .radius = instance.radius,
+                       .r = instance.color.r,
+                       .g = instance.color.g,
+                       .b = instance.color.b});
+    }
+
+    TraceSettings settings;
+    GeodesicTracer tracer(settings, std::move(discs));
+    vector<uint8_t> pixels(4 * static_cast<size_t>(settings.width) * settings.height);
+    TraceStats stats = tracer.render(pixels.data());
+    savePPM(tracePath, pixels.data(), {settings.width, settings.height}, true);
+
+    cout << "trace: " << stats.rays << " rays in " << stats.seconds << " s on " << stats.threads
+         << " threads, " << stats.rays / stats.seconds / 1e6 << " Mrays/s, "
+         << stats.steps / stats.seconds / 1e6 << " Msteps/s" << endl;
+    return EXIT_SUCCESS;
+  }
+
+  VulkanEngine engine(800, 800, 2, validation, "Vulkan Engine working!", headless);
   engine.checkValidationLayerSupport();
+  engine.headlessFrameCount = frames;
+  engine.headlessOutputPath = output;
+  engine.simulation = simulation;
+  engine.simulatedBodyCount = bodies;
+  engine.gridBodyCount = gridBodies;
+  engine.vertexLayout = vertexLayout;
+  engine.simulationRate = simulationRate;
+  engine.lensing = lensing;
+  engine.pipelineCachePath = pipelineCachePath;
+  engine.profilePath = profilePath;
+  engine.perfReportPath = reportPath;
 
   try {
     engine.run();